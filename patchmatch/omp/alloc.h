@@ -0,0 +1,63 @@
+#ifndef ALLOC_H_
+#define ALLOC_H_
+
+#include <stddef.h>
+
+// where the pages of a buffer go on a NUMA host
+typedef enum {
+    PLACE_LOCAL,        // node of the thread that first writes each page
+    PLACE_INTERLEAVE,   // round robin over all nodes, for randomly read buffers
+} placement_t;
+
+#define HUGE_PAGE_SIZE (2UL << 20)
+
+/**
+ * Page aligned buffer whose pages are not touched yet. With PLACE_LOCAL 
+ * fill it from the threads that will use it, in the same static row split 
+ * as the kernels, and each page lands on their node. Buffers of at least 
+ * HUGE_PAGE_SIZE are aligned to it and asked to be backed by transparent 
+ * huge pages, if the kernel declines they stay on normal pages. Running 
+ * out of address space ends the program.
+ */
+void *buffer_alloc(size_t bytes, placement_t place = PLACE_LOCAL);
+void buffer_free(void *buf);
+
+/**
+ * Bump allocator over one buffer_alloc block, for everything a job needs. 
+ * Allocations are ARENA_ALIGN aligned and live until the arena is rewound. 
+ * Reserving again for a job of the same size keeps the block, so its pages 
+ * are already faulted in and placed.
+ */
+#define ARENA_ALIGN 64
+
+typedef struct {
+    char *base;
+    size_t capacity;
+    size_t used;
+} arena_t;
+
+void arena_init(arena_t *arena);
+// empties the arena, the block is only replaced when it is too small
+void arena_reserve(arena_t *arena, size_t bytes);
+// ends the program when the reservation was too small
+void *arena_alloc(arena_t *arena, size_t bytes, placement_t place = PLACE_LOCAL);
+// room an allocation takes in the arena, alignment included
+size_t arena_bytes(size_t bytes, placement_t place = PLACE_LOCAL);
+// frees everything allocated since used was mark
+void arena_rewind(arena_t *arena, size_t mark);
+void arena_release(arena_t *arena);
+
+// bytes of the mappings holding [buf, buf + bytes) currently backed by 
+// transparent huge pages
+size_t huge_page_bytes(const void *buf, size_t bytes);
+
+// thread affinity for the OpenMP team
+typedef enum {
+    BIND_NONE,          // leave placement to the OS
+    BIND_CLOSE,         // thread t on the t-th allowed core
+    BIND_SPREAD,        // threads spaced evenly over the allowed cores
+} bind_policy_t;
+
+void bind_threads(bind_policy_t policy);
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef DISTANCE_H_
+#define DISTANCE_H_
+
+#include "image.h"
+
+// instruction sets the distance kernels are compiled for
+typedef enum {
+    ISA_SCALAR = 0,
+    ISA_SSE4,
+    ISA_AVX2,
+    ISA_AVX512,
+    ISA_COUNT
+} dist_isa_t;
+
+// largest half patch size with its own unrolled kernel
+#define MAX_SPECIALIZED_PATCH 10
+
+// most candidates patch_distance_batch() scores in one call, every one 
+// of them is bounded by the best from before the call
+#define PATCH_BATCH 4
+
+// pick the widest kernel the cpu supports, called once before searching
+void distance_init();
+dist_isa_t distance_isa();
+const char *distance_isa_name();
+bool distance_specialized(int half_patch);
+
+// per pixel distance functions
+float sum_squared_diff(float *fpixel, float *spixel);
+float sum_absolute_diff(float *fpixel, float *spixel);
+
+// sum of squared differences between the patch around (fx, fy) in first 
+// and the patch around (sx, sy) in second, pixels outside are clamped. 
+// Both images have the same shape and a halo of at least half_patch, 
+// which supplies the clamped pixels.
+float patch_distance(const image_t *first, const image_t *second, 
+    int fx, int fy, int sx, int sy, int half_patch = 1);
+
+// same distance, but gives up at the first patch row where the partial 
+// sum reaches bound and counts that in cut_short, so any result >= bound 
+// means the candidate lost
+float patch_distance_bounded(const image_t *first, const image_t *second, 
+    int fx, int fy, int sx, int sy, float bound, 
+    int half_patch, long *cut_short);
+
+// bounded distances of n <= PATCH_BATCH candidates (sx[k], sy[k]) for 
+// the patch around (fx, fy) into dist[k], scored together so the target 
+// patch is read once for all of them
+void patch_distance_batch(const image_t *first, const image_t *second, 
+    int fx, int fy, const int *sx, const int *sy, int n, float bound, 
+    float *dist, int half_patch, long *cut_short);
+
+// same distance, updated from prev_dist of the pair at (fx - dx, fy - dy) 
+// and (sx - dx, sy - dy) by one row or column, (dx, dy) is a unit step
+float patch_distance_shift(const image_t *first, const image_t *second, 
+    int fx, int fy, int sx, int sy, float prev_dist, int dx, int dy, 
+    int half_patch = 1);
+
+#endif
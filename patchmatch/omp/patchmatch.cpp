@@ -2,6 +2,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #if OMP
 #include "omp.h"
@@ -9,11 +10,21 @@
 
 #include "util.h"
 #include "patchmatch.h"
+#include "rng.h"
+#include "tiles.h"
+#include "pool.h"
 #include "cycletimer.h"
 
 #define CHUNKSIZE1 16
 #define CHUNKSIZE2 32
 
+// wavefront tile rows and columns
+#define WAVEFRONT_TILE1 32
+#define WAVEFRONT_TILE2 64
+
+// first jump flooding stride, halved down to 1 every pass
+#define JUMP_FLOOD_MAX_STEP 16
+
 using namespace cv;
 using namespace std;
 
@@ -22,52 +33,68 @@ inline int get_pidx(int y, int x, int w) { return y * w + x; }
 
 inline int get_cidx(int y, int x, int w, int c) { return (y * w + x) * N_CHANNELS + c; }
 
-inline float square(float x) { return x * x; }
-
-inline float sum_squared_diff(float *fpixel, float *spixel)
+// score a candidate, giving up once it cannot beat bound
+inline float candidate_distance(const image_t *first, const image_t *second, 
+    int fx, int fy, int sx, int sy, float bound, 
+    int half_patch, search_stats_t *stats)
 {
-    float dist = sqrt(
-        square(fpixel[0] - spixel[0]) +
-        square(fpixel[1] - spixel[1]) +
-        square(fpixel[2] - spixel[2])
-    );
-    return dist;
+    stats->evals++;
+    return patch_distance_bounded(first, second, fx, fy, sx, sy, bound, 
+        half_patch, &stats->cut_short);
 }
 
-inline float sum_absolute_diff(float *fpixel, float *spixel)
+// fold one thread's counters into the shared ones
+inline void merge_stats(search_stats_t *stats, const search_stats_t *local)
 {
-    float dist = sqrt(
-        abs(fpixel[0] - spixel[0]) +
-        abs(fpixel[1] - spixel[1]) +
-        abs(fpixel[2] - spixel[2])
-    );
-    return dist;
-}
+    if (!stats) return;
 
-inline float patch_distance(float *first, float *second, 
-    int fx, int fy, int sx, int sy, 
-    int height, int width, int half_patch)
-{
-    float dist = 0;
-    for (int j = -HALF_PATCH; j <= HALF_PATCH; j++) {
-        for (int i = -HALF_PATCH; i <= HALF_PATCH; i++) {
-            int fx1 = min(width - 1, max(0, fx + i));
-            int fy1 = min(height - 1, max(0, fy + i));
-            float *fpixel = first + get_pidx(fy1, fx1, width) * N_CHANNELS;
+    #if OMP
+    #pragma omp atomic
+    #endif
+    stats->evals += local->evals;
+    #if OMP
+    #pragma omp atomic
+    #endif
+    stats->cut_short += local->cut_short;
+    #if OMP
+    #pragma omp atomic
+    #endif
+    stats->improved += local->improved;
+    #if OMP
+    #pragma omp atomic
+    #endif
+    stats->dist_drop += local->dist_drop;
+}
 
-            int sx1 = min(width - 1, max(0, sx + i));
-            int sy1 = min(height - 1, max(0, sy + i));
-            float *spixel = second + get_pidx(sy1, sx1, width) * N_CHANNELS;
 
-            dist += sum_squared_diff(fpixel, spixel);
-        }
-    }
-    return dist;
+void default_options(pm_options_t *opt)
+{
+    opt->half_patch = HALF_PATCH;
+    opt->seed = 0;
+    opt->levels = 0;
+    opt->fine_iterations = FINE_ITERATIONS;
+    opt->max_iterations = NUM_ITERATIONS;
+    opt->min_improvement = CONVERGENCE_THRESHOLD;
+    opt->time_budget = 0;
+    opt->search_samples = SEARCH_SAMPLES;
+    opt->prefetch_rows = PREFETCH_ROWS;
+    opt->report_huge_pages = false;
+    opt->check_field = false;
+    opt->mode = SEARCH_WAVEFRONT;
+    opt->src_placement = PLACE_LOCAL;
 }
 
+const char *search_mode_name(search_mode_t mode)
+{
+    static const char *names[SEARCH_MODE_COUNT] = {
+        "block", "interleave", "dynamic", "wavefront", "checkerboard", 
+        "jumpflood", "async", "pool", "staged", "batched"
+    };
+    return names[mode];
+}
 
 void pick_random_pixel(int radius, int height, int width, 
-    int sx, int sy, int *rx_ptr, int *ry_ptr)
+    int sx, int sy, rng_t *rng, int *rx_ptr, int *ry_ptr)
 {
     int xmin = max(sx - radius, 0);
     int xmax = min(sx + radius, width);
@@ -77,351 +104,1493 @@ void pick_random_pixel(int radius, int height, int width,
     int xlen = xmax - xmin;
     int ylen = ymax - ymin;
 
-    *rx_ptr = (random() % xlen) + xmin;
-    *ry_ptr = (random() % ylen) + ymin;
+    *rx_ptr = rng_range(rng, xlen) + xmin;
+    *ry_ptr = rng_range(rng, ylen) + ymin;
+}
+
+/**
+ * Probe opt->search_samples random pixels in windows around the best match 
+ * whose radius halves from min(MAX_SEARCH_RADIUS, image size) down to 1. 
+ * Every probe is scored against the best distance so far.
+ */
+void random_search(const image_t *first, const image_t *second, int fx, int fy, 
+    int height, int width, const pm_options_t *opt, rng_t *rng, 
+    int *best_x, int *best_y, float *best_dist, search_stats_t *stats)
+{
+    int search_radius = min(MAX_SEARCH_RADIUS, max(width, height));
+
+    for (int radius = search_radius; radius >= 1; radius /= 2) {
+        for (int k = 0; k < opt->search_samples; k++) {
+            int rx, ry;
+            pick_random_pixel(radius, height, width, 
+                *best_x, *best_y, rng, &rx, &ry);
+            if (rx == *best_x && ry == *best_y) continue;
+
+            float dist = candidate_distance(first, second, fx, fy, rx, ry, 
+                *best_dist, opt->half_patch, stats);
+
+            if (dist < *best_dist) {
+                *best_x = rx;
+                *best_y = ry;
+                *best_dist = dist;
+            }
+        }
+    }
+}
+
+/**
+ * Scan direction of pass iter, 1 is top-left to bottom-right. Every other 
+ * pass runs backward and propagates from the right and lower neighbors, 
+ * so good matches spread both ways.
+ */
+static inline int scan_direction(int iter)
+{
+    return (iter % 2 == 0) ? -1 : 1;
+}
+
+/**
+ * Prefetch the top opt->prefetch_rows rows of the candidate pixel (fx, fy) 
+ * propagates from its upper neighbor, called a pixel ahead of the scan. 
+ * The candidate from its left neighbor is the match the scan is about to 
+ * pick, so it is not known yet.
+ */
+static inline void prefetch_propagated(const image_t *second, const map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, int fx, int fy)
+{
+    int dir = scan_direction(iter);
+    if (fx < 0 || fx >= width || fy - dir < 0 || fy - dir >= height) return;
+
+    int pf = (fy - dir) * width + fx;
+    int py = curMap->y[pf] + dir;
+    if (py >= 0 && py < height) {
+        image_prefetch_rows(second, curMap->x[pf], py, opt->half_patch, opt->prefetch_rows);
+    }
+}
+
+size_t map_bytes(int height, int width)
+{
+    size_t n = (size_t) height * width;
+    return 2 * arena_bytes(n * sizeof(uint16_t)) + arena_bytes(n * sizeof(dist_t));
+}
+
+void map_wrap(map_t *map, void *buf, int height, int width)
+{
+    size_t n = (size_t) height * width;
+    char *p = (char *) buf;
+
+    map->x = (uint16_t *) p;
+    p += arena_bytes(n * sizeof(uint16_t));
+    map->y = (uint16_t *) p;
+    p += arena_bytes(n * sizeof(uint16_t));
+    map->dist = (dist_t *) p;
 }
 
 // For each pixel in first, random assign a nn pixel in second
-void init_random_map(float *first, float *second, map_t *map, 
-    int height, int width, int half_patch)
+void init_random_map(const image_t *first, const image_t *second, map_t *map, 
+    int height, int width, const pm_options_t *opt)
 {
+    int half_patch = opt->half_patch;
+
+    tile_sched_t sched;
+    tile_sched_init(&sched, height, width, omp_get_max_threads());
+
     #if OMP
     #pragma omp parallel
     #endif
     {
-        int T = omp_get_num_threads();
-        int Ty = (int) ceil(sqrt((double) T));
-        int Tx = T / Ty;
+        int tid = omp_get_thread_num();
+        tile_t tile;
 
-        int t = omp_get_thread_num();
-        int ty = t / Tx;
-        int tx = t % Tx;
+        while (tile_sched_next(&sched, tid, &tile)) {
+            for (int y = tile.y_begin; y < tile.y_end; y++) {
+                for (int x = tile.x_begin; x < tile.x_end; x++) {
+                    int idx = y * width + x;
+                    rng_t rng;
+                    rng_init(&rng, opt->seed, idx, 0);
+                    int rx = rng_range(&rng, width);
+                    int ry = rng_range(&rng, height);
 
-        int y_interval = (height + Ty - 1) / Ty;
-        int x_interval = (width + Tx - 1) / Tx;
-        
-        int y_start = y_interval * ty;
-        int y_end = min(y_interval * (ty + 1), height);
-        int x_start = x_interval * tx;
-        int x_end = min(x_interval * (tx + 1), width);
-        
-        for (int y = y_start; y < y_end; y++ ) {
-            for (int x = x_start; x < x_end; x++ ) {
-                int rx = random() % width;
-                int ry = random() % height;
-                int idx = y * width + x;
-
-                map[idx].x = rx;
-                map[idx].y = ry;
-                map[idx].dist = patch_distance(first, second, x, y, rx, ry, 
-                    height, width, half_patch);
+                    set_entry(map, idx, rx, ry, patch_distance(first, second, x, y, rx, ry, 
+                        half_patch));
+                }
             }
         }
     }
+    tile_sched_free(&sched);
 }
 
-void nn_search_helper(float *first, float *second, map_t *curMap, 
-    int height, int width, int half_patch, int fy, int fx)
+/**
+ * Offer pixel (fx, fy) the matches of its neighbors before it in scan 
+ * order. (x_start, y_start) is the first pixel, in the pass's scan order, 
+ * of the region the calling thread owns, neighbors past it were updated by 
+ * the same thread. A neighbor match equal to the best so far, as 
+ * throughout coherent regions, is not scored again, the shifted distance 
+ * would only add its rounding to the stored one.
+ */
+static inline void propagate(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, int fy, int fx, 
+    int y_start, int x_start, 
+    int *best_x, int *best_y, float *best_dist, search_stats_t *stats)
 {
-    // int search_radius = min(MAX_SEARCH_RADIUS, min(width, height));
-    // int search_radius = max(width, height);
-    // int search_radius = min(5, max(width, height));
+    int half_patch = opt->half_patch;
 
+    int dir = scan_direction(iter);
     int f = (fy * width) + fx;
-    int best_x = curMap[f].x; 
-    int best_y = curMap[f].y; 
-    float best_dist = curMap[f].dist;
 
-    // propagate
-    if (fx > 0) {
+    if (fx - dir >= 0 && fx - dir < width) {
         // find neighbor's patch
-        int pf = f - 1;
-        int px = curMap[pf].x + 1;
-        int py = curMap[pf].y;
+        int pf = f - dir;
+        int px = curMap->x[pf] + dir;
+        int py = curMap->y[pf];
+        bool seen = px == *best_x && py == *best_y;
         
-        if (px < width) { 
-            float dist = patch_distance(first, second, fx, fy, px, py, height, width, half_patch);
+        if (px >= 0 && px < width && !seen) { 
+            #if INCREMENTAL_DISTANCE
+            // the neighbor's distance is only consistent if this thread wrote it
+            float dist = (fx != x_start) ?
+                patch_distance_shift(first, second, fx, fy, px, py, 
+                    get_dist(curMap, pf), dir, 0, half_patch) :
+                candidate_distance(first, second, fx, fy, px, py, 
+                    *best_dist, half_patch, stats);
+            #else
+            float dist = candidate_distance(first, second, fx, fy, px, py, 
+                *best_dist, half_patch, stats);
+            #endif
             
-            if (dist < best_dist) {
-                best_x = px; 
-                best_y = py;
-                best_dist = dist;
+            if (dist < *best_dist) {
+                *best_x = px; 
+                *best_y = py;
+                *best_dist = dist;
             }
         }
     }
 
-    if (fy > 0) {
+    if (fy - dir >= 0 && fy - dir < height) {
         // find neighbor's patch
-        int pf = f - width;
-        int px = curMap[pf].x;
-        int py = curMap[pf].y + 1;
+        int pf = f - dir * width;
+        int px = curMap->x[pf];
+        int py = curMap->y[pf] + dir;
+        bool seen = px == *best_x && py == *best_y;
         
-        if (py < height) { 
-            float dist = patch_distance(first, second, fx, fy, px, py, height, width, half_patch);
+        if (py >= 0 && py < height && !seen) { 
+            #if INCREMENTAL_DISTANCE
+            // the neighbor's distance is only consistent if this thread wrote it
+            float dist = (fy != y_start) ?
+                patch_distance_shift(first, second, fx, fy, px, py, 
+                    get_dist(curMap, pf), 0, dir, half_patch) :
+                candidate_distance(first, second, fx, fy, px, py, 
+                    *best_dist, half_patch, stats);
+            #else
+            float dist = candidate_distance(first, second, fx, fy, px, py, 
+                *best_dist, half_patch, stats);
+            #endif
             
-            if (dist < best_dist) {
-                best_x = px; 
-                best_y = py;
-                best_dist = dist;
+            if (dist < *best_dist) {
+                *best_x = px; 
+                *best_y = py;
+                *best_dist = dist;
             }
         }
     }
+}
+
+// search pixel (fx, fy), see propagate() for (x_start, y_start)
+void nn_search_helper(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, int fy, int fx, 
+    int y_start, int x_start, search_stats_t *stats)
+{
+    int f = (fy * width) + fx;
+    if (opt->prefetch_rows > 0) {
+        prefetch_propagated(second, curMap, height, width, opt, iter, 
+            fx + scan_direction(iter), fy);
+    }
+
+    int best_x = curMap->x[f]; 
+    int best_y = curMap->y[f]; 
+    float best_dist = get_dist(curMap, f);
+
+    propagate(first, second, curMap, height, width, opt, iter, fy, fx, 
+        y_start, x_start, &best_x, &best_y, &best_dist, stats);
 
     // random search
-    int radius = 15;
-    int rx, ry;
-    pick_random_pixel(radius, height, width, 
-        best_x, best_y, &rx, &ry);
-
-    float dist = patch_distance(first, second, fx, fy, rx, ry, height, width, half_patch);
-
-    if (dist < best_dist) {
-        best_x = rx;
-        best_y = ry;
-        best_dist = dist;
-    } 
+    rng_t rng;
+    rng_init(&rng, opt->seed, f, iter);
+    random_search(first, second, fx, fy, height, width, opt, &rng, 
+        &best_x, &best_y, &best_dist, stats);
     
-    curMap[f].x = best_x;
-    curMap[f].y = best_y;
-    curMap[f].dist = best_dist;
+    if (best_x != curMap->x[f] || best_y != curMap->y[f]) {
+        stats->improved++;
+        stats->dist_drop += get_dist(curMap, f) - best_dist;
+    }
+
+    set_entry(curMap, f, best_x, best_y, best_dist);
             
 }
 
-void nn_search_interleave(float *first, float *second, map_t *curMap, 
-    int height, int width, int half_patch)
+/**
+ * Search the pixels in [y_begin, y_end) x [x_begin, x_end) in the pass's 
+ * scan order, backward passes start from the bottom-right corner
+ */
+static void nn_search_region(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, 
+    int y_begin, int y_end, int x_begin, int x_end, search_stats_t *stats)
+{
+    int dir = scan_direction(iter);
+    int y_start = (dir > 0) ? y_begin : y_end - 1;
+    int x_start = (dir > 0) ? x_begin : x_end - 1;
+
+    for (int j = 0; j < y_end - y_begin; j++) {
+        int fy = y_start + dir * j;
+
+        for (int i = 0; i < x_end - x_begin; i++) {
+            int fx = x_start + dir * i;
+            nn_search_helper(first, second, curMap, 
+                height, width, opt, iter, fy, fx, y_start, x_start, stats);
+        }
+    }
+}
+
+void nn_search_interleave(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, 
+    search_stats_t *stats)
 {
     #if OMP
     #pragma omp parallel
     #endif
     {
+        search_stats_t local = {0, 0, 0, 0};
         int T = omp_get_num_threads();
-        int Tx = (int) floor(sqrt((double) T));
-        int Ty = T / Tx;
-
         int t = omp_get_thread_num();
-        int ty = t / Tx;
-        int tx = t % Tx;
-
-        int y_interval = CHUNKSIZE1 * Ty;
-        int x_interval = CHUNKSIZE2 * Tx;
-        int yy_start = CHUNKSIZE1 * ty;
-        int xx_start = CHUNKSIZE2 * tx;
-
-        for (int y_start = yy_start; y_start < height; y_start += y_interval) {
-            for (int x_start = xx_start; x_start < width; x_start += x_interval) {
-                int y_end = min(y_start + CHUNKSIZE1, height);
-                int x_end = min(x_start + CHUNKSIZE2, width);
-
-                for (int fy = y_start; fy < y_end; fy++) {
-                    for (int fx = x_start; fx < x_end; fx++) {
-                        nn_search_helper(first, second, curMap, 
-                            height, width, half_patch, fy, fx);
+
+        // deal tiles round robin in row major order, every thread gets some
+        int tiles_y = (height + CHUNKSIZE1 - 1) / CHUNKSIZE1;
+        int tiles_x = (width + CHUNKSIZE2 - 1) / CHUNKSIZE2;
+
+        for (int k = t; k < tiles_y * tiles_x; k += T) {
+            int y_start = (k / tiles_x) * CHUNKSIZE1;
+            int x_start = (k % tiles_x) * CHUNKSIZE2;
+            int y_end = min(y_start + CHUNKSIZE1, height);
+            int x_end = min(x_start + CHUNKSIZE2, width);
+
+            nn_search_region(first, second, curMap, height, width, opt, iter, 
+                y_start, y_end, x_start, x_end, &local);
+        }
+        merge_stats(stats, &local);
+    }
+}
+
+void nn_search_dynamic(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, 
+    search_stats_t *stats)
+{
+    #if OMP
+    #pragma omp parallel
+    #endif
+    {
+        search_stats_t local = {0, 0, 0, 0};
+
+        int dir = scan_direction(iter);
+
+        #if OMP
+        #pragma omp for schedule(dynamic, 8)
+        #endif
+        for (int j = 0; j < height; j++) {
+            int fy = (dir > 0) ? j : height - 1 - j;
+            nn_search_region(first, second, curMap, height, width, opt, iter, 
+                fy, fy + 1, 0, width, &local);
+        }
+        merge_stats(stats, &local);
+    }
+}
+
+/**
+ * Tiles are colored like a checkerboard and each pass updates one color 
+ * after the other. The left, right, upper and lower neighbors of a tile 
+ * have the other color and stay frozen while it runs, so no entry is read 
+ * while another thread writes it and the field does not depend on the 
+ * thread count or timing.
+ */
+void nn_search_checkerboard(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, 
+    search_stats_t *stats)
+{
+    int dir = scan_direction(iter);
+    int tiles_y = (height + CHUNKSIZE1 - 1) / CHUNKSIZE1;
+    int tiles_x = (width + CHUNKSIZE2 - 1) / CHUNKSIZE2;
+
+    #if OMP
+    #pragma omp parallel
+    #endif
+    {
+        search_stats_t local = {0, 0, 0, 0};
+
+        for (int half = 0; half < 2; half++) {
+            int color = (dir > 0) ? half : 1 - half;
+
+            // the implicit barrier ends the half pass
+            #if OMP
+            #pragma omp for schedule(dynamic)
+            #endif
+            for (int t = 0; t < tiles_y * tiles_x; t++) {
+                int ty = t / tiles_x;
+                int tx = t % tiles_x;
+                if ((ty + tx) % 2 != color) continue;
+
+                int y_start = ty * CHUNKSIZE1;
+                int x_start = tx * CHUNKSIZE2;
+                nn_search_region(first, second, curMap, height, width, opt, iter, 
+                    y_start, min(y_start + CHUNKSIZE1, height), 
+                    x_start, min(x_start + CHUNKSIZE2, width), &local);
+            }
+        }
+        merge_stats(stats, &local);
+    }
+}
+
+/**
+ * Tiles run as tasks that wait for the tiles before them in scan order, 
+ * so they sweep the image along anti-diagonals. Every pixel sees the same 
+ * neighbors as in the sequential scan and the field matches it exactly.
+ */
+void nn_search_wavefront(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, 
+    search_stats_t *stats)
+{
+    int dir = scan_direction(iter);
+    int tiles_y = (height + WAVEFRONT_TILE1 - 1) / WAVEFRONT_TILE1;
+    int tiles_x = (width + WAVEFRONT_TILE2 - 1) / WAVEFRONT_TILE2;
+
+    // whole image is one region, so every neighbor is safe to shift from
+    int y_origin = (dir > 0) ? 0 : height - 1;
+    int x_origin = (dir > 0) ? 0 : width - 1;
+
+    // dependency tokens, one per tile plus one for the image border
+    char *done = (char *) malloc(tiles_y * tiles_x + 1);
+    char *border = &done[tiles_y * tiles_x];
+
+    #if OMP
+    #pragma omp parallel
+    #pragma omp single
+    #endif
+    for (int j = 0; j < tiles_y; j++) {
+        int ty = (dir > 0) ? j : tiles_y - 1 - j;
+
+        for (int i = 0; i < tiles_x; i++) {
+            int tx = (dir > 0) ? i : tiles_x - 1 - i;
+            char *tile = &done[ty * tiles_x + tx];
+            char *prev_y = (j > 0) ? tile - dir * tiles_x : border;
+            char *prev_x = (i > 0) ? tile - dir : border;
+
+            #if OMP
+            #pragma omp task firstprivate(ty, tx) \
+                depend(in: *prev_y, *prev_x) depend(out: *tile)
+            #endif
+            {
+                search_stats_t local = {0, 0, 0, 0};
+                int y_begin = ty * WAVEFRONT_TILE1;
+                int y_end = min(y_begin + WAVEFRONT_TILE1, height);
+                int x_begin = tx * WAVEFRONT_TILE2;
+                int x_end = min(x_begin + WAVEFRONT_TILE2, width);
+                int y_first = (dir > 0) ? y_begin : y_end - 1;
+                int x_first = (dir > 0) ? x_begin : x_end - 1;
+
+                for (int fj = 0; fj < y_end - y_begin; fj++) {
+                    for (int fi = 0; fi < x_end - x_begin; fi++) {
+                        nn_search_helper(first, second, curMap, height, width, 
+                            opt, iter, y_first + dir * fj, x_first + dir * fi, 
+                            y_origin, x_origin, &local);
                     }
                 }
+                merge_stats(stats, &local);
             }
         }
     }
+
+    free(done);
 }
 
-void nn_search_dynamic(float *first, float *second, map_t *curMap, 
-    int height, int width, int half_patch)
+// offer pixel (fx, fy) the matches of its eight neighbors step away in prev
+static void jump_flood_pixel(const image_t *first, const image_t *second, map_t *prev, map_t *next, 
+    int height, int width, const pm_options_t *opt, int iter, int step, 
+    int fy, int fx, search_stats_t *stats)
 {
+    static const int dirs[8][2] = {
+        {-1, -1}, {0, -1}, {1, -1}, {-1, 0}, {1, 0}, {-1, 1}, {0, 1}, {1, 1}
+    };
+
+    int f = (fy * width) + fx;
+    int best_x = prev->x[f];
+    int best_y = prev->y[f];
+    float best_dist = get_dist(prev, f);
+
+    for (int d = 0; d < 8; d++) {
+        int nx = fx + dirs[d][0] * step;
+        int ny = fy + dirs[d][1] * step;
+        if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
+
+        // the neighbor's match, shifted back to this pixel
+        int pf = (ny * width) + nx;
+        int px = prev->x[pf] - dirs[d][0] * step;
+        int py = prev->y[pf] - dirs[d][1] * step;
+        if (px < 0 || px >= width || py < 0 || py >= height) continue;
+        if (px == best_x && py == best_y) continue;
+
+        float dist = candidate_distance(first, second, fx, fy, px, py, 
+            best_dist, opt->half_patch, stats);
+
+        if (dist < best_dist) {
+            best_x = px;
+            best_y = py;
+            best_dist = dist;
+        }
+    }
+
+    if (step == 1) {
+        rng_t rng;
+        rng_init(&rng, opt->seed, f, iter);
+        random_search(first, second, fx, fy, height, width, opt, &rng, 
+            &best_x, &best_y, &best_dist, stats);
+    }
+
+    set_entry(next, f, best_x, best_y, best_dist);
+}
+
+/**
+ * Jump flooding pass. Strides halve from JUMP_FLOOD_MAX_STEP down to 1 and 
+ * every step reads only the previous step's field, so pixels within a 
+ * step are independent and a step is a plain parallel sweep with one 
+ * barrier. The last step adds the random search.
+ */
+void nn_search_jump_flood(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, arena_t *arena, 
+    search_stats_t *stats)
+{
+    int step = JUMP_FLOOD_MAX_STEP;
+    while (step > 1 && step >= max(height, width)) step /= 2;
+
+    // curMap is kept until the end to count the pass's improvements
+    size_t mark = arena->used;
+    size_t bytes = map_bytes(height, width);
+    map_t bufs[2];
+    map_wrap(&bufs[0], arena_alloc(arena, bytes), height, width);
+    map_wrap(&bufs[1], arena_alloc(arena, bytes), height, width);
+    int steps = 0;
+    for (int s = step; s >= 1; s /= 2) steps++;
+
     #if OMP
-    #pragma omp parallel for schedule(dynamic, 8)
+    #pragma omp parallel
     #endif
-    for (int fy = 0; fy < height; fy++) {
-        for (int fx = 0; fx < width; fx++) {
-            nn_search_helper(first, second, curMap, 
-                height, width, half_patch, fy, fx);
+    {
+        search_stats_t local = {0, 0, 0, 0};
+
+        for (int s = step, k = 0; s >= 1; s /= 2, k++) {
+            map_t *prev = (k == 0) ? curMap : &bufs[(k - 1) % 2];
+            map_t *next = &bufs[k % 2];
+
+            #if OMP
+            #pragma omp for schedule(static)
+            #endif
+            for (int fy = 0; fy < height; fy++) {
+                for (int fx = 0; fx < width; fx++) {
+                    jump_flood_pixel(first, second, prev, next, 
+                        height, width, opt, iter, s, fy, fx, &local);
+                }
+            }
+
         }
+
+        merge_stats(stats, &local);
     }
-    
+
+    map_t *result = &bufs[(steps - 1) % 2];
+    long improved = 0;
+    double dist_drop = 0;
+
+    #if OMP
+    #pragma omp parallel for reduction(+:improved, dist_drop)
+    #endif
+    for (int f = 0; f < height * width; f++) {
+        if (result->x[f] != curMap->x[f] || result->y[f] != curMap->y[f]) {
+            improved++;
+            dist_drop += get_dist(curMap, f) - get_dist(result, f);
+        }
+    }
+
+    search_stats_t change = {0, 0, improved, dist_drop};
+    merge_stats(stats, &change);
+
+    size_t n = (size_t) height * width;
+    memcpy(curMap->x, result->x, n * sizeof(uint16_t));
+    memcpy(curMap->y, result->y, n * sizeof(uint16_t));
+    memcpy(curMap->dist, result->dist, n * sizeof(dist_t));
+    arena_rewind(arena, mark);
 }
 
-void nn_search(float *first, float *second, map_t *curMap, 
-    int height, int width, int half_patch)
+void nn_search_block(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, 
+    search_stats_t *stats)
 {
+    // backward passes also take the tiles from the bottom-right
+    tile_sched_t sched;
+    tile_sched_init(&sched, height, width, omp_get_max_threads(), 
+        scan_direction(iter) < 0);
+
     #if OMP
     #pragma omp parallel
     #endif
     {
-        int T = omp_get_num_threads();
-        int Ty = (int) ceil(sqrt((double) T));
-        int Tx = T / Ty;
+        search_stats_t local = {0, 0, 0, 0};
+        int tid = omp_get_thread_num();
+        tile_t tile;
 
-        int t = omp_get_thread_num();
-        int ty = t / Tx;
-        int tx = t % Tx;
+        while (tile_sched_next(&sched, tid, &tile)) {
+            nn_search_region(first, second, curMap, height, width, opt, iter, 
+                tile.y_begin, tile.y_end, tile.x_begin, tile.x_end, &local);
+        }
+        merge_stats(stats, &local);
+    }
+    tile_sched_free(&sched);
+}
 
-        int y_interval = (height + Ty - 1) / Ty;
-        int x_interval = (width + Tx - 1) / Tx;
-        
-        int y_start = y_interval * ty;
-        int y_end = min(y_interval * (ty + 1), height);
-        int x_start = x_interval * tx;
-        int x_end = min(x_interval * (tx + 1), width);
-
-        for (int fy = y_start; fy < y_end; fy++) {
-            for (int fx = x_start; fx < x_end; fx++) {
-                nn_search_helper(first, second, curMap, 
-                    height, width, half_patch, fy, fx);
+/**
+ * Block mode on CHUNKSIZE1 x CHUNKSIZE2 tiles, each copied with its halo 
+ * into the thread's scratch image before it is searched. Every candidate 
+ * then reads the target patch from that small contiguous copy, which stays 
+ * in L1/L2, instead of from rows a full image stride apart.
+ */
+void nn_search_staged(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, arena_t *arena, 
+    search_stats_t *stats)
+{
+    int pad = opt->half_patch;
+    size_t scratch_bytes = arena_bytes(image_bytes(CHUNKSIZE1, CHUNKSIZE2, pad));
+    size_t mark = arena->used;
+    char *scratch_bufs = (char *) arena_alloc(arena, 
+        omp_get_max_threads() * scratch_bytes);
+
+    tile_sched_t sched;
+    tile_sched_init(&sched, height, width, omp_get_max_threads(), 
+        scan_direction(iter) < 0, CHUNKSIZE1, CHUNKSIZE2);
+
+    #if OMP
+    #pragma omp parallel
+    #endif
+    {
+        search_stats_t local = {0, 0, 0, 0};
+        int tid = omp_get_thread_num();
+        // written only by this thread, so its pages are on the thread's node
+        void *scratch_buf = scratch_bufs + tid * scratch_bytes;
+        image_t scratch;
+        tile_t tile;
+
+        while (tile_sched_next(&sched, tid, &tile)) {
+            image_copy_tile(first, &scratch, scratch_buf, 
+                tile.y_begin, tile.y_end, tile.x_begin, tile.x_end, pad);
+            nn_search_region(&scratch, second, curMap, height, width, opt, iter, 
+                tile.y_begin, tile.y_end, tile.x_begin, tile.x_end, &local);
+        }
+        merge_stats(stats, &local);
+    }
+    tile_sched_free(&sched);
+    arena_rewind(arena, mark);
+}
+
+// a candidate match gathered for the batched mode
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+} candidate_t;
+
+// random probes random_search() draws for a pixel
+static int probe_count(int height, int width, const pm_options_t *opt)
+{
+    int radii = 0;
+    for (int r = min(MAX_SEARCH_RADIUS, max(width, height)); r >= 1; r /= 2) radii++;
+    return radii * opt->search_samples;
+}
+
+/**
+ * Draw the random probes of pixel (fx, fy) around its match (mx, my) into 
+ * probes, leaving out the match itself and repeats, which the small radii 
+ * produce all the time. Returns how many are left.
+ */
+static int gather_probes(int height, int width, const pm_options_t *opt, 
+    int iter, int fx, int fy, int mx, int my, candidate_t *probes)
+{
+    rng_t rng;
+    rng_init(&rng, opt->seed, (fy * width) + fx, iter);
+    int search_radius = min(MAX_SEARCH_RADIUS, max(width, height));
+    int n = 0;
+
+    for (int radius = search_radius; radius >= 1; radius /= 2) {
+        for (int k = 0; k < opt->search_samples; k++) {
+            int rx, ry;
+            pick_random_pixel(radius, height, width, mx, my, &rng, &rx, &ry);
+
+            bool seen = (rx == mx && ry == my);
+            for (int c = 0; c < n && !seen; c++) {
+                seen = (probes[c].x == rx && probes[c].y == ry);
             }
+            if (seen) continue;
+
+            probes[n].x = (uint16_t) rx;
+            probes[n].y = (uint16_t) ry;
+            n++;
         }
     }
+    return n;
 }
 
+/**
+ * Score the n probes of pixel (fx, fy) PATCH_BATCH at a time, each batch 
+ * bounded by the best distance found before it. The first probe below 
+ * the best wins ties, the same one scoring them in turn would pick. With 
+ * prefetch_rows > 0 the top rows of the next batch are asked for while 
+ * one is scored, from the probes already gathered.
+ */
+static void score_probes(const image_t *first, const image_t *second, 
+    int fx, int fy, const candidate_t *probes, int n, int half_patch, 
+    int prefetch_rows, int *best_x, int *best_y, float *best_dist, 
+    search_stats_t *stats)
+{
+    int sx[PATCH_BATCH], sy[PATCH_BATCH];
+    float dist[PATCH_BATCH];
 
-void nn_map(float *src, float *dst, map_t *map,
-    int height, int width)
+    for (int k0 = 0; k0 < n; k0 += PATCH_BATCH) {
+        int m = min(PATCH_BATCH, n - k0);
+        for (int k = 0; k < m; k++) {
+            sx[k] = probes[k0 + k].x;
+            sy[k] = probes[k0 + k].y;
+        }
+        for (int k = k0 + m; prefetch_rows > 0 && k < min(n, k0 + m + PATCH_BATCH); k++) {
+            image_prefetch_rows(second, probes[k].x, probes[k].y, half_patch, prefetch_rows);
+        }
+
+        stats->evals += m;
+        patch_distance_batch(first, second, fx, fy, sx, sy, m, *best_dist, dist, 
+            half_patch, &stats->cut_short);
+
+        for (int k = 0; k < m; k++) {
+            if (dist[k] < *best_dist) {
+                *best_x = sx[k];
+                *best_y = sy[k];
+                *best_dist = dist[k];
+            }
+        }
+    }
+}
+
+// per thread scratch of the batched mode, one pixel's probes
+static size_t batched_scratch_bytes(int height, int width, const pm_options_t *opt)
+{
+    return arena_bytes(probe_count(height, width, opt) * sizeof(candidate_t));
+}
+
+/**
+ * Search tile in the pass's order. Each pixel propagates as 
+ * nn_search_region() does, with the cheap shifted distance, then draws its 
+ * random probes once around the best match so far and scores them in 
+ * batches. All radii are drawn around that one match, while 
+ * random_search() moves its window to every better probe it finds, so the 
+ * result is close to block mode's but not the same.
+ */
+static void nn_search_tile_batched(const image_t *first, const image_t *second, 
+    map_t *curMap, int height, int width, const pm_options_t *opt, int iter, 
+    const tile_t *tile, candidate_t *probes, search_stats_t *stats)
+{
+    int dir = scan_direction(iter);
+    int y_start = (dir > 0) ? tile->y_begin : tile->y_end - 1;
+    int x_start = (dir > 0) ? tile->x_begin : tile->x_end - 1;
+
+    for (int j = 0; j < tile->y_end - tile->y_begin; j++) {
+        int fy = y_start + dir * j;
+
+        for (int i = 0; i < tile->x_end - tile->x_begin; i++) {
+            int fx = x_start + dir * i;
+            int f = (fy * width) + fx;
+            if (opt->prefetch_rows > 0) {
+                prefetch_propagated(second, curMap, height, width, opt, iter, fx + dir, fy);
+            }
+
+            int best_x = curMap->x[f];
+            int best_y = curMap->y[f];
+            float best_dist = get_dist(curMap, f);
+
+            propagate(first, second, curMap, height, width, opt, iter, fy, fx, 
+                y_start, x_start, &best_x, &best_y, &best_dist, stats);
+
+            int n = gather_probes(height, width, opt, iter, fx, fy, 
+                best_x, best_y, probes);
+            score_probes(first, second, fx, fy, probes, n, opt->half_patch, 
+                opt->prefetch_rows, &best_x, &best_y, &best_dist, stats);
+
+            if (best_x != curMap->x[f] || best_y != curMap->y[f]) {
+                stats->improved++;
+                stats->dist_drop += get_dist(curMap, f) - best_dist;
+            }
+            set_entry(curMap, f, best_x, best_y, best_dist);
+        }
+    }
+}
+
+/**
+ * Experimental: block mode on CHUNKSIZE1 x CHUNKSIZE2 tiles with each 
+ * pixel's random probes scored in batches, see nn_search_tile_batched(). 
+ * It has not been faster than block mode so far, each batch is cut short 
+ * against the bound from before it rather than the best of its own 
+ * probes. Probes equal to the best so far or to an earlier probe are not 
+ * scored again. Each thread's scratch is a slice of one arena block, 
+ * written only by that thread.
+ */
+void nn_search_batched(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, arena_t *arena, 
+    search_stats_t *stats)
 {
+    size_t scratch_bytes = batched_scratch_bytes(height, width, opt);
+    size_t mark = arena->used;
+    char *scratch_bufs = (char *) arena_alloc(arena, 
+        omp_get_max_threads() * scratch_bytes);
+
+    tile_sched_t sched;
+    tile_sched_init(&sched, height, width, omp_get_max_threads(), 
+        scan_direction(iter) < 0, CHUNKSIZE1, CHUNKSIZE2);
+
     #if OMP
     #pragma omp parallel
     #endif
     {
-        int T = omp_get_num_threads();
-        int Tx = (int) floor(sqrt((double) T));
-        int Ty = T / Tx;
+        search_stats_t local = {0, 0, 0, 0};
+        int tid = omp_get_thread_num();
+        candidate_t *probes = (candidate_t *) (scratch_bufs + tid * scratch_bytes);
+        tile_t tile;
 
-        int t = omp_get_thread_num();
-        int ty = t / Tx;
-        int tx = t % Tx;
+        while (tile_sched_next(&sched, tid, &tile)) {
+            nn_search_tile_batched(first, second, curMap, height, width, opt, iter, 
+                &tile, probes, &local);
+        }
+        merge_stats(stats, &local);
+    }
+    tile_sched_free(&sched);
+    arena_rewind(arena, mark);
+}
 
-        int y_interval = (height + Ty - 1) / Ty;
-        int x_interval = (width + Tx - 1) / Tx;
-        
-        int y_start = y_interval * ty;
-        int y_end = min(y_interval * (ty + 1), height);
-        int x_start = x_interval * tx;
-        int x_end = min(x_interval * (tx + 1), width);
-
-        for (int dy = y_start; dy < y_end; dy++) {
-            for (int dx = x_start; dx < x_end; dx++) {
-                int idx = get_pidx(dy, dx, width);
-
-                if (map[idx].x < 0 || map[idx].x >= width) {
-                    cout << "Bad X position " << map[idx].x 
-                        << " at (" << dx << ", " << dy << ")" << endl;
+/**
+ * Packed field entry for the async mode: x in bits 0-15, y in 16-31 and 
+ * the distance's float bits in 32-63, so one atomic load always sees a 
+ * match together with its own distance.
+ */
+static inline uint64_t pack_entry(int x, int y, float dist)
+{
+    uint32_t bits;
+    memcpy(&bits, &dist, sizeof(bits));
+    return (uint64_t) (uint16_t) x | ((uint64_t) (uint16_t) y << 16) 
+        | ((uint64_t) bits << 32);
+}
+
+static inline void unpack_entry(uint64_t e, int *x, int *y, float *dist)
+{
+    uint32_t bits = (uint32_t) (e >> 32);
+    *x = (int) (e & 0xffff);
+    *y = (int) ((e >> 16) & 0xffff);
+    memcpy(dist, &bits, sizeof(bits));
+}
+
+static inline uint64_t load_entry(uint64_t *field, int f)
+{
+    return __atomic_load_n(&field[f], __ATOMIC_RELAXED);
+}
+
+// async counterpart of nn_search_helper on the packed field
+static void async_pixel(const image_t *first, const image_t *second, uint64_t *field, 
+    int height, int width, const pm_options_t *opt, int iter, 
+    int fy, int fx, search_stats_t *stats)
+{
+    int half_patch = opt->half_patch;
+    int dir = scan_direction(iter);
+    int f = (fy * width) + fx;
+    int best_x, best_y;
+    float best_dist;
+    unpack_entry(load_entry(field, f), &best_x, &best_y, &best_dist);
+    float start_dist = best_dist;
+
+    // propagate, entries are never torn so the shift is always safe
+    for (int axis = 0; axis < 2; axis++) {
+        int dx = (axis == 0) ? dir : 0;
+        int dy = (axis == 0) ? 0 : dir;
+        if (fx - dx < 0 || fx - dx >= width || fy - dy < 0 || fy - dy >= height) continue;
+
+        int nx, ny;
+        float ndist;
+        unpack_entry(load_entry(field, f - dx - dy * width), &nx, &ny, &ndist);
+        int px = nx + dx;
+        int py = ny + dy;
+        if (px < 0 || px >= width || py < 0 || py >= height) continue;
+        if (px == best_x && py == best_y) continue;
+
+        #if INCREMENTAL_DISTANCE
+        float dist = patch_distance_shift(first, second, fx, fy, px, py, 
+            ndist, dx, dy, half_patch);
+        #else
+        float dist = candidate_distance(first, second, fx, fy, px, py, 
+            best_dist, half_patch, stats);
+        #endif
+
+        if (dist < best_dist) {
+            best_x = px;
+            best_y = py;
+            best_dist = dist;
+        }
+    }
+
+    rng_t rng;
+    rng_init(&rng, opt->seed, f, iter);
+    random_search(first, second, fx, fy, height, width, opt, &rng, 
+        &best_x, &best_y, &best_dist, stats);
+
+    if (best_dist >= start_dist) return;
+
+    // publish unless a later pass on another thread already did better
+    uint64_t cur = load_entry(field, f);
+    uint64_t want = pack_entry(best_x, best_y, best_dist);
+    while (true) {
+        int cx, cy;
+        float cur_dist;
+        unpack_entry(cur, &cx, &cy, &cur_dist);
+        if (cur_dist <= best_dist) break;
+
+        if (__atomic_compare_exchange_n(&field[f], &cur, want, false, 
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            if (cx != best_x || cy != best_y) {
+                stats->improved++;
+                stats->dist_drop += cur_dist - best_dist;
+            }
+            break;
+        }
+    }
+}
+
+// progress of one async pass, the drop is rounded to whole distance units
+typedef struct {
+    long drop;
+    int tiles_done;
+} async_pass_t;
+
+/**
+ * Whether a thread reaching pass may stop the level: once the deadline is 
+ * past, or once the latest pass with all of its tiles done removed less 
+ * than min_improvement of the distance left before it.
+ */
+static bool async_should_stop(const async_pass_t *progress, int pass, int tiles, 
+    double level_dist, double min_improvement, double deadline)
+{
+    if (deadline > 0 && currentSeconds() >= deadline) return true;
+
+    for (int q = pass - 1; q >= 0; q--) {
+        if (__atomic_load_n(&progress[q].tiles_done, __ATOMIC_ACQUIRE) < tiles) continue;
+
+        double before = level_dist;
+        for (int r = 0; r < q; r++) {
+            before -= __atomic_load_n(&progress[r].drop, __ATOMIC_RELAXED);
+        }
+        return __atomic_load_n(&progress[q].drop, __ATOMIC_RELAXED) 
+            < min_improvement * before;
+    }
+    return false;
+}
+
+/**
+ * Run up to passes passes from iter on without a barrier between them and 
+ * return how many were started in full. Tiles of all passes are handed out 
+ * from one dynamic loop in pass order and every entry is a packed 64 bit 
+ * word updated by compare and swap, so improvements reach neighbors as 
+ * soon as they are made and a tile may overlap the same tile of the next 
+ * pass. With no barrier to stop at, each thread checks opt->min_improvement 
+ * and the deadline (0 is none) when it moves on to its next pass, and 
+ * skips the remaining tiles once either says stop.
+ */
+int nn_search_async(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, int passes, 
+    double level_dist, double deadline, arena_t *arena, search_stats_t *stats)
+{
+    int tiles_y = (height + CHUNKSIZE1 - 1) / CHUNKSIZE1;
+    int tiles_x = (width + CHUNKSIZE2 - 1) / CHUNKSIZE2;
+    int tiles = tiles_y * tiles_x;
+    int stop = passes;
+    size_t mark = arena->used;
+    uint64_t *field = (uint64_t *) arena_alloc(arena, 
+        (size_t) height * width * sizeof(uint64_t));
+    async_pass_t *progress = (async_pass_t *) arena_alloc(arena, 
+        passes * sizeof(async_pass_t));
+    memset(progress, 0, passes * sizeof(async_pass_t));
+
+    #if OMP
+    #pragma omp parallel
+    #endif
+    {
+        search_stats_t local = {0, 0, 0, 0};
+        int cur_pass = 0;
+
+        #if OMP
+        #pragma omp for schedule(static)
+        #endif
+        for (int f = 0; f < height * width; f++) {
+            field[f] = pack_entry(curMap->x[f], curMap->y[f], get_dist(curMap, f));
+        }
+
+        #if OMP
+        #pragma omp for schedule(dynamic)
+        #endif
+        for (int k = 0; k < passes * tiles; k++) {
+            int pass = k / tiles;
+            if (pass != cur_pass) {
+                cur_pass = pass;
+                if (async_should_stop(progress, pass, tiles, level_dist, 
+                        opt->min_improvement, deadline)) {
+                    // lower stop to pass unless another thread already did
+                    int seen = __atomic_load_n(&stop, __ATOMIC_RELAXED);
+                    while (pass < seen && !__atomic_compare_exchange_n(&stop, &seen, 
+                        pass, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
                 }
-                else if (map[idx].y < 0 || map[idx].y >= height) {
-                    cout << "Bad Y position " << map[idx].y 
-                        << " at (" << dx << ", " << dy << ")" << endl;
+            }
+            if (pass >= __atomic_load_n(&stop, __ATOMIC_RELAXED)) continue;
+
+            int pass_iter = iter + pass;
+            int dir = scan_direction(pass_iter);
+            int t = (dir > 0) ? k % tiles : tiles - 1 - k % tiles;
+
+            int y_begin = (t / tiles_x) * CHUNKSIZE1;
+            int x_begin = (t % tiles_x) * CHUNKSIZE2;
+            int rows = min(CHUNKSIZE1, height - y_begin);
+            int cols = min(CHUNKSIZE2, width - x_begin);
+            int y_first = (dir > 0) ? y_begin : y_begin + rows - 1;
+            int x_first = (dir > 0) ? x_begin : x_begin + cols - 1;
+            double drop = local.dist_drop;
+
+            for (int j = 0; j < rows; j++) {
+                for (int i = 0; i < cols; i++) {
+                    async_pixel(first, second, field, height, width, opt, pass_iter, 
+                        y_first + dir * j, x_first + dir * i, &local);
                 }
-                else {
-                    int midx = get_pidx(map[idx].y, map[idx].x, width);
-                    dst[idx * N_CHANNELS + 0] = src[midx * N_CHANNELS + 0];
-                    dst[idx * N_CHANNELS + 1] = src[midx * N_CHANNELS + 1];
-                    dst[idx * N_CHANNELS + 2] = src[midx * N_CHANNELS + 2];
+            }
+
+            __atomic_fetch_add(&progress[pass].drop, (long) (local.dist_drop - drop), 
+                __ATOMIC_RELAXED);
+            __atomic_fetch_add(&progress[pass].tiles_done, 1, __ATOMIC_RELEASE);
+        }
+
+        #if OMP
+        #pragma omp for schedule(static)
+        #endif
+        for (int f = 0; f < height * width; f++) {
+            int x, y;
+            float dist;
+            unpack_entry(field[f], &x, &y, &dist);
+            set_entry(curMap, f, x, y, dist);
+        }
+
+        merge_stats(stats, &local);
+    }
+
+    arena_rewind(arena, mark);
+    return stop;
+}
+
+typedef struct {
+    const image_t *first;
+    const image_t *second;
+    map_t *curMap;
+    int height;
+    int width;
+    const pm_options_t *opt;
+    int iter;
+    tile_sched_t *sched;
+    search_stats_t *stats;
+} search_job_t;
+
+static void search_job(int tid, int nthreads, void *arg)
+{
+    search_job_t *job = (search_job_t *) arg;
+    search_stats_t local = {0, 0, 0, 0};
+    tile_t tile;
+
+    while (tile_sched_next(job->sched, tid, &tile)) {
+        nn_search_region(job->first, job->second, job->curMap, job->height, job->width, 
+            job->opt, job->iter, tile.y_begin, tile.y_end, tile.x_begin, tile.x_end, &local);
+    }
+    merge_stats(job->stats, &local);
+}
+
+// block mode on the persistent pool, the workers stay alive between passes
+void nn_search_pool(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, 
+    search_stats_t *stats)
+{
+    tile_sched_t sched;
+    tile_sched_init(&sched, height, width, pool_size(), scan_direction(iter) < 0);
+
+    search_job_t job = {first, second, curMap, height, width, opt, iter, &sched, stats};
+    pool_run(search_job, &job);
+
+    tile_sched_free(&sched);
+}
+
+void nn_search(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, arena_t *arena, 
+    search_stats_t *stats)
+{
+    switch (opt->mode) {
+        case SEARCH_INTERLEAVE:
+            nn_search_interleave(first, second, curMap, height, width, opt, iter, stats);
+            break;
+        case SEARCH_DYNAMIC:
+            nn_search_dynamic(first, second, curMap, height, width, opt, iter, stats);
+            break;
+        case SEARCH_WAVEFRONT:
+            nn_search_wavefront(first, second, curMap, height, width, opt, iter, stats);
+            break;
+        case SEARCH_CHECKERBOARD:
+            nn_search_checkerboard(first, second, curMap, height, width, opt, iter, stats);
+            break;
+        case SEARCH_JUMP_FLOOD:
+            nn_search_jump_flood(first, second, curMap, height, width, opt, iter, arena, stats);
+            break;
+        case SEARCH_ASYNC:
+            nn_search_async(first, second, curMap, height, width, opt, iter, 1, 
+                0, 0, arena, stats);
+            break;
+        case SEARCH_POOL:
+            nn_search_pool(first, second, curMap, height, width, opt, iter, stats);
+            break;
+        case SEARCH_STAGED:
+            nn_search_staged(first, second, curMap, height, width, opt, iter, arena, stats);
+            break;
+        case SEARCH_BATCHED:
+            nn_search_batched(first, second, curMap, height, width, opt, iter, arena, stats);
+            break;
+        default:
+            nn_search_block(first, second, curMap, height, width, opt, iter, stats);
+    }
+}
+
+
+/**
+ * Seed a field from the one on the next coarser level. Each pixel takes 
+ * its parent's match scaled by two plus its own offset within the parent.
+ */
+void nn_upsample(const image_t *first, const image_t *second, map_t *coarse, map_t *fine, 
+    int coarse_height, int coarse_width, int height, int width, int half_patch)
+{
+    #if OMP
+    #pragma omp parallel for schedule(static)
+    #endif
+    for (int y = 0; y < height; y++) {
+        int cy = min(y / 2, coarse_height - 1);
+
+        for (int x = 0; x < width; x++) {
+            int cx = min(x / 2, coarse_width - 1);
+            int parent = get_pidx(cy, cx, coarse_width);
+            int sx = min(width - 1, coarse->x[parent] * 2 + (x - cx * 2));
+            int sy = min(height - 1, coarse->y[parent] * 2 + (y - cy * 2));
+
+            set_entry(fine, get_pidx(y, x, width), sx, sy, 
+                patch_distance(first, second, x, y, sx, sy, half_patch));
+        }
+    }
+}
+
+double nn_total_distance(map_t *map, int height, int width)
+{
+    double total = 0;
+
+    #if OMP
+    #pragma omp parallel for reduction(+:total)
+    #endif
+    for (int f = 0; f < height * width; f++) {
+        total += get_dist(map, f);
+    }
+    return total;
+}
+
+/**
+ * Entries whose stored distance is off from the distance of their patches 
+ * by more than rounding, incremental updates and bfloat16 storage included
+ */
+long nn_check_distances(const image_t *first, const image_t *second, map_t *map, 
+    int height, int width, int half_patch)
+{
+    float tolerance = FIELD_BF16_DIST ? 1.0f / 64 : 1e-3f;
+    long wrong = 0;
+
+    #if OMP
+    #pragma omp parallel for reduction(+:wrong) schedule(static)
+    #endif
+    for (int f = 0; f < height * width; f++) {
+        float dist = patch_distance(first, second, f % width, f / width, 
+            map->x[f], map->y[f], half_patch);
+        if (fabsf(get_dist(map, f) - dist) > tolerance * max(dist, 1.0f)) {
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+void nn_map(const image_t *src, image_t *dst, map_t *map,
+    int height, int width)
+{
+    tile_sched_t sched;
+    tile_sched_init(&sched, height, width, omp_get_max_threads());
+
+    #if OMP
+    #pragma omp parallel
+    #endif
+    {
+        int tid = omp_get_thread_num();
+        tile_t tile;
+
+        while (tile_sched_next(&sched, tid, &tile)) {
+            for (int dy = tile.y_begin; dy < tile.y_end; dy++) {
+                for (int dx = tile.x_begin; dx < tile.x_end; dx++) {
+                    int idx = get_pidx(dy, dx, width);
+
+                    if (map->x[idx] >= width) {
+                        cout << "Bad X position " << map->x[idx] 
+                            << " at (" << dx << ", " << dy << ")" << endl;
+                    }
+                    else if (map->y[idx] >= height) {
+                        cout << "Bad Y position " << map->y[idx] 
+                            << " at (" << dx << ", " << dy << ")" << endl;
+                    }
+                    else {
+                        const pixel_t *spixel = image_pixel(src, map->x[idx], map->y[idx]);
+                        pixel_t *dpixel = image_pixel(dst, dx, dy);
+                        dpixel[0] = spixel[0];
+                        dpixel[1] = spixel[1];
+                        dpixel[2] = spixel[2];
+                    }
                 }
             }
         }
     }
-    
+    tile_sched_free(&sched);
 }
 
-void nn_map_average(float *src, float *dst, map_t *map, 
+void nn_map_average(const image_t *src, image_t *dst, map_t *map, 
     int height, int width, int half_patch)
 {
-    half_patch = max(1, HALF_PATCH / 2);
+    half_patch = max(1, half_patch / 2);
+
+    tile_sched_t sched;
+    tile_sched_init(&sched, height, width, omp_get_max_threads());
 
     #if OMP
     #pragma omp parallel
     #endif
     {
-        int T = omp_get_num_threads();
-        int Ty = (int) ceil(sqrt((double) T));
-        int Tx = T / Ty;
+        int tid = omp_get_thread_num();
+        tile_t tile;
 
-        int t = omp_get_thread_num();
-        int ty = t / Tx;
-        int tx = t % Tx;
+        while (tile_sched_next(&sched, tid, &tile)) {
+            for (int dy = tile.y_begin; dy < tile.y_end; dy++) {
+                int fy_min = max(dy - half_patch, 0);
+                int fy_max = min(dy + half_patch, height - 1);
+                int fy_len = fy_max - fy_min + 1;
 
-        int y_interval = (height + Ty - 1) / Ty;
-        int x_interval = (width + Tx - 1) / Tx;
-        
-        int y_start = y_interval * ty;
-        int y_end = min(y_interval * (ty + 1), height);
-        int x_start = x_interval * tx;
-        int x_end = min(x_interval * (tx + 1), width);
-
-        for (int dy = y_start; dy < y_end; dy++) {        
-            int fy_min = max(dy - half_patch, 0);
-            int fy_max = min(dy + half_patch, height - 1);
-            int fy_len = fy_max - fy_min + 1;
-
-            for (int dx = x_start; dx < x_end; dx++) {
-                int fx_min = max(dx - half_patch, 0);
-                int fx_max = min(dx + half_patch, width - 1);
-                int fx_len = fx_max - fx_min + 1;
-
-                int pixel_sums[3];
-                pixel_sums[0] = pixel_sums[1] = pixel_sums[2] = 0;
+                for (int dx = tile.x_begin; dx < tile.x_end; dx++) {
+                    int fx_min = max(dx - half_patch, 0);
+                    int fx_max = min(dx + half_patch, width - 1);
+                    int fx_len = fx_max - fx_min + 1;
+
+                    int pixel_sums[3];
+                    pixel_sums[0] = pixel_sums[1] = pixel_sums[2] = 0;
                 
-                for (int fy = fy_min; fy <= fy_max; fy++) {
-                    for (int fx = fx_min; fx <= fx_max; fx++) {
-                        int f = fy * width + fx;
-                        int px = map[f].x;
-                        int py = map[f].y;
-
-                        float *spixel = src + get_pidx(py, px, width) * N_CHANNELS;
-                        pixel_sums[0] += spixel[0];
-                        pixel_sums[1] += spixel[1];
-                        pixel_sums[2] += spixel[2];
+                    for (int fy = fy_min; fy <= fy_max; fy++) {
+                        for (int fx = fx_min; fx <= fx_max; fx++) {
+                            int f = fy * width + fx;
+                            int px = map->x[f];
+                            int py = map->y[f];
+
+                            const pixel_t *spixel = image_pixel(src, px, py);
+                            pixel_sums[0] += pixel_value(spixel[0]);
+                            pixel_sums[1] += pixel_value(spixel[1]);
+                            pixel_sums[2] += pixel_value(spixel[2]);
+                        }
                     }
-                }
 
-                int num_pixels = fy_len * fx_len;
+                    int num_pixels = fy_len * fx_len;
 
-                float *dpixel = dst + get_pidx(dy, dx, width) * N_CHANNELS;
-                dpixel[0] = pixel_sums[0] / num_pixels;
-                dpixel[1] = pixel_sums[1] / num_pixels;
-                dpixel[2] = pixel_sums[2] / num_pixels;
+                    pixel_t *dpixel = image_pixel(dst, dx, dy);
+                    dpixel[0] = to_pixel(pixel_sums[0] / num_pixels);
+                    dpixel[1] = to_pixel(pixel_sums[1] / num_pixels);
+                    dpixel[2] = to_pixel(pixel_sums[2] / num_pixels);
+                }
             }
         }
     }
+    tile_sched_free(&sched);
 }
 
-void patchmatch(float *src, float *dst, int height, int width, int half_patch)
+// number of levels such that the coarsest keeps PYRAMID_MIN_SIZE pixels
+static int pyramid_levels(int height, int width, const pm_options_t *opt)
 {
-    double t1, time_init, time_search = 0, time_map;
-    map_t *curMap = (map_t *) malloc(height * width * sizeof(map_t));
+    int levels = 1;
+    int size = min(height, width);
 
+    while (levels < MAX_PYRAMID_LEVELS && size / 2 >= PYRAMID_MIN_SIZE) {
+        size /= 2;
+        levels++;
+    }
+    return opt->levels > 0 ? min(opt->levels, levels) : levels;
+}
+
+/**
+ * Scratch one pass of opt->mode takes from the arena and hands back before 
+ * it returns, largest on level 0
+ */
+static size_t search_arena_size(int height, int width, const pm_options_t *opt)
+{
+    switch (opt->mode) {
+        case SEARCH_JUMP_FLOOD:
+            return 2 * arena_bytes(map_bytes(height, width));
+        case SEARCH_ASYNC:
+            return arena_bytes((size_t) height * width * sizeof(uint64_t)) 
+                + arena_bytes(max(opt->max_iterations, opt->fine_iterations) 
+                    * sizeof(async_pass_t));
+        case SEARCH_STAGED:
+            // one tile copy a thread
+            return arena_bytes(omp_get_max_threads() 
+                * arena_bytes(image_bytes(CHUNKSIZE1, CHUNKSIZE2, opt->half_patch)));
+        case SEARCH_BATCHED:
+            return arena_bytes(omp_get_max_threads() * batched_scratch_bytes(height, width, opt));
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Level l > 0 of both pyramids, two field slots the levels alternate 
+ * between: slot 0 for even levels, sized for level 0, and slot 1 for odd 
+ * levels, sized for level 1, and the search's pass scratch.
+ */
+size_t patchmatch_arena_size(int height, int width, const pm_options_t *opt)
+{
+    int levels = pyramid_levels(height, width, opt);
+    int pad = opt->half_patch;
+    size_t bytes = 0;
+    int h = height;
+    int w = width;
+
+    bytes += arena_bytes(map_bytes(h, w));
+    bytes += search_arena_size(h, w, opt);
+    #if DEBUG
+    if (SAVE_ITER_OUTPUT) {
+        bytes += arena_bytes(image_bytes(h, w, pad));
+    }
+    #endif
+    for (int l = 1; l < levels; l++) {
+        h = (h + 1) / 2;
+        w = (w + 1) / 2;
+        size_t level_bytes = image_bytes(h, w, pad);
+        bytes += arena_bytes(level_bytes, opt->src_placement) + arena_bytes(level_bytes);
+        if (l == 1) {
+            bytes += arena_bytes(map_bytes(h, w));
+        }
+    }
+    return bytes;
+}
+
+/**
+ * Coarse to fine search. The coarsest level starts from a random field and 
+ * runs up to opt->max_iterations passes, every finer level starts from the 
+ * upsampled field of the level below and runs up to opt->fine_iterations. 
+ * A level stops early once a pass removes less than opt->min_improvement 
+ * of its total distance, and every level stops once the time budget is 
+ * spent, the remaining levels are then only upsampled.
+ */
+void patchmatch(image_t *src, image_t *dst, int height, int width, 
+    const pm_options_t *opt, arena_t *arena)
+{
+    int half_patch = opt->half_patch;
+    double t1, time_init = 0, time_search = 0, time_map;
+    search_stats_t stats = {0, 0, 0, 0};
+    map_t *curMap = NULL;
+    int iter = 0;
+
+    if (src->pad < half_patch || dst->pad < half_patch) {
+        cout << "Images need a halo of " << half_patch << " pixels" << endl;
+        return;
+    }
+
+    distance_init();
+    cout << "Distance kernel: " << distance_isa_name() 
+        << (distance_specialized(half_patch) ? "" : " (generic size)") << endl;
+    cout << "Search mode: " << search_mode_name(opt->mode) << endl;
+
+    // started once, the workers then live across all passes and levels
+    if (opt->mode == SEARCH_POOL) {
+        pool_init(omp_get_max_threads());
+    }
+
+    // level 0 is the full resolution image
+    int levels = pyramid_levels(height, width, opt);
+    image_t src_pyr[MAX_PYRAMID_LEVELS], dst_pyr[MAX_PYRAMID_LEVELS];
+    int heights[MAX_PYRAMID_LEVELS], widths[MAX_PYRAMID_LEVELS];
+
+    // everything below is carved from the arena and handed back at the end
+    size_t mark = arena->used;
+    map_t map_slots[2];
+    map_wrap(&map_slots[0], arena_alloc(arena, map_bytes(height, width)), height, width);
+    #if DEBUG
+    // sized for level 0, every level lays its image out over it
+    void *scratch_buf = SAVE_ITER_OUTPUT ? 
+        arena_alloc(arena, image_bytes(height, width, half_patch)) : NULL;
+    #endif
+
+    // the caller wrote the pixels, the halos are ours
     t1 = currentSeconds();
-    init_random_map(dst, src, curMap, height, width, half_patch);
-    time_init = currentSeconds() - t1;
+    image_fill_halo(src);
+    image_fill_halo(dst);
+    src_pyr[0] = *src;
+    dst_pyr[0] = *dst;
+    heights[0] = height;
+    widths[0] = width;
+    for (int l = 1; l < levels; l++) {
+        heights[l] = (heights[l - 1] + 1) / 2;
+        widths[l] = (widths[l - 1] + 1) / 2;
+        size_t level_bytes = image_bytes(heights[l], widths[l], half_patch);
+        image_wrap(&src_pyr[l], arena_alloc(arena, level_bytes, opt->src_placement), 
+            heights[l], widths[l], half_patch);
+        image_wrap(&dst_pyr[l], arena_alloc(arena, level_bytes), 
+            heights[l], widths[l], half_patch);
+        pyr_down_image(&src_pyr[l - 1], &src_pyr[l]);
+        pyr_down_image(&dst_pyr[l - 1], &dst_pyr[l]);
+    }
+    double time_pyramid = currentSeconds() - t1;
 
-    for (int i = 1; i <= NUM_ITERATIONS; i++) {
-        #if DEBUG
-        cout << "PATCHMATCH iteration " << i << endl;
-        #endif
+    if (levels > 1) {
+        map_wrap(&map_slots[1], arena_alloc(arena, map_bytes(heights[1], widths[1])), 
+            heights[1], widths[1]);
+    }
+
+    for (int l = levels - 1; l >= 0; l--) {
+        int h = heights[l];
+        int w = widths[l];
+        const image_t *src_l = &src_pyr[l];
+        const image_t *dst_l = &dst_pyr[l];
+        // first written by the parallel init or upsample
+        map_t *levelMap = &map_slots[l % 2];
+        // the slot is sized for the largest level it holds, lay it out for this one
+        map_wrap(levelMap, levelMap->x, h, w);
 
         t1 = currentSeconds();
-        nn_search(dst, src, curMap, height, width, half_patch);
-        // nn_search_interleave(dst, src, curMap, height, width, half_patch);
-        // nn_search_dynamic(dst, src, curMap, height, width, half_patch);
-        time_search += currentSeconds() - t1;
-
-        #if DEBUG
-        if (SAVE_ITER_OUTPUT && (i % 4) == 0) {
-            char fname[64];
-            sprintf(fname, "../scratch/pm-iter-%i.jpg", i);
-            cout << fname << endl;
-
-            float *cur;
-            clone_array(dst, &cur, height, width);
-            nn_map_average(src, cur, curMap, height, width, half_patch);
-            imwrite_array(fname, cur, height, width, 3);
-            free(cur);
+        if (curMap == NULL) {
+            init_random_map(dst_l, src_l, levelMap, h, w, opt);
+        }
+        else {
+            nn_upsample(dst_l, src_l, curMap, levelMap, 
+                heights[l + 1], widths[l + 1], h, w, half_patch);
+        }
+        curMap = levelMap;
+        time_init += currentSeconds() - t1;
+
+        int max_iterations = (l == levels - 1) ? opt->max_iterations : opt->fine_iterations;
+        double level_dist = nn_total_distance(curMap, h, w);
+        search_stats_t pass = {0, 0, 0, 0};
+        int i, passes = 1;
+
+        for (i = 1; i <= max_iterations; i += passes) {
+            if (opt->time_budget > 0 && time_search >= opt->time_budget) {
+                break;
+            }
+
+            pass = {0, 0, 0, 0};
+            t1 = currentSeconds();
+            if (opt->mode == SEARCH_ASYNC) {
+                // all of the level's passes in one call, without barriers, 
+                // it checks convergence and the time budget itself
+                double deadline = (opt->time_budget > 0) 
+                    ? t1 + opt->time_budget - time_search : 0;
+                passes = nn_search_async(dst_l, src_l, curMap, h, w, opt, iter + 1, 
+                    max_iterations - i + 1, level_dist, deadline, arena, &pass);
+            }
+            else {
+                nn_search(dst_l, src_l, curMap, h, w, opt, iter + 1, arena, &pass);
+            }
+            iter += passes;
+            time_search += currentSeconds() - t1;
+            merge_stats(&stats, &pass);
+
+            #if DEBUG
+            cout << "PATCHMATCH level " << l << " iteration " << i 
+                << ": improved " << pass.improved << " pixels, distance -" 
+                << (100.0 * pass.dist_drop / max(level_dist, 1.0)) << "%" << endl;
+            #endif
+
+            // async already ran or stopped all of the level's passes
+            bool converged = opt->mode == SEARCH_ASYNC 
+                || pass.dist_drop < opt->min_improvement * level_dist;
+            level_dist -= pass.dist_drop;
+
+            #if DEBUG
+            if (SAVE_ITER_OUTPUT && (iter % 4) == 0) {
+                char fname[64];
+                sprintf(fname, "../scratch/pm-iter-%i.jpg", iter);
+                cout << fname << endl;
+
+                image_t scratch;
+                image_wrap(&scratch, scratch_buf, h, w, half_patch);
+                clone_image(dst_l, &scratch);
+                nn_map_average(src_l, &scratch, curMap, h, w, half_patch);
+                imwrite_image(fname, &scratch, 3);
+            }
+            #endif
+
+            if (converged) {
+                i += passes;
+                break;
+            }
+        }
+
+        // async counts every improvement of all the level's passes
+        cout << "Level " << l << ": " << (i - 1) << " passes, last call made " 
+            << pass.improved << " improvements over " << (h * w) << " pixels" << endl;
+
+        if (opt->check_field) {
+            long wrong = nn_check_distances(dst_l, src_l, curMap, h, w, half_patch);
+            if (wrong > 0) {
+                fprintf(stderr, "patchmatch: level %d has %ld of %d field distances "
+                    "that do not match their patches\n", l, wrong, h * w);
+                exit(-1);
+            }
         }
-        #endif
     }
 
+    double total_dist = nn_total_distance(curMap, height, width);
+
+    // while the pyramid and the field are still allocated
+    size_t huge_bytes = opt->report_huge_pages ? 
+        huge_page_bytes(arena->base, arena->capacity) : 0;
+
     t1 = currentSeconds();
     nn_map_average(src, dst, curMap, height, width, half_patch);
     time_map = currentSeconds() - t1;
 
-    free(curMap);
+    if (opt->mode == SEARCH_POOL) {
+        pool_shutdown();
+    }
+
+    arena_rewind(arena, mark);
 
+    cout << "Pyramid levels: " << levels << endl;
+    cout << "Search iterations: " << iter << endl;
+    cout << "Mean patch distance: " << (total_dist / (height * width)) << endl;
+    cout << "Time pyramid: "<< time_pyramid << endl;
     cout << "Time init: "<< time_init << endl;
-    cout << "Time search per iter: "<< (time_search / NUM_ITERATIONS) << endl;
+    cout << "Time search per iter: "<< (time_search / max(1, iter)) << endl;
     cout << "Time map: "<< time_map << endl;
+    cout << "Early exits: " << stats.cut_short << " of " << stats.evals 
+        << " evaluations (" << (100.0 * stats.cut_short / max(1L, stats.evals)) << "%)" << endl;
+    if (opt->report_huge_pages) {
+        cout << "Huge pages in the arena: " << (huge_bytes / HUGE_PAGE_SIZE) << " (" 
+            << (huge_bytes >> 20) << " MB)" << endl;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,44 @@
+#ifndef RNG_H_
+#define RNG_H_
+
+#include <stdint.h>
+
+/**
+ * Counter based random numbers. Every (seed, pixel, iteration) triple owns 
+ * an independent SplitMix64 stream, so draws need no shared state and do 
+ * not depend on which thread visits the pixel or in what order.
+ */
+typedef struct {
+    uint64_t key;
+    uint64_t ctr;
+} rng_t;
+
+#define RNG_GAMMA 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t rng_mix(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline void rng_init(rng_t *rng, uint32_t seed, uint32_t pixel, uint32_t iter)
+{
+    uint64_t key = rng_mix(((uint64_t) seed << 32 | iter) + RNG_GAMMA);
+    rng->key = rng_mix(key ^ ((uint64_t) pixel * RNG_GAMMA));
+    rng->ctr = 0;
+}
+
+static inline uint32_t rng_next(rng_t *rng)
+{
+    rng->ctr += RNG_GAMMA;
+    return (uint32_t) (rng_mix(rng->key + rng->ctr) >> 32);
+}
+
+// uniform in [0, n)
+static inline int rng_range(rng_t *rng, int n)
+{
+    return (int) (((uint64_t) rng_next(rng) * (uint32_t) n) >> 32);
+}
+
+#endif
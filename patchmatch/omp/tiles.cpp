@@ -0,0 +1,112 @@
+#include <stdlib.h>
+#include <algorithm>
+
+#include "tiles.h"
+
+using namespace std;
+
+static inline uint64_t pack_range(uint32_t head, uint32_t tail)
+{
+    return (uint64_t) tail << 32 | head;
+}
+
+static inline uint32_t range_head(uint64_t r) { return (uint32_t) r; }
+
+static inline uint32_t range_tail(uint64_t r) { return (uint32_t) (r >> 32); }
+
+void tile_sched_init(tile_sched_t *sched, int height, int width, int nthreads, 
+    bool reverse, int tile_rows, int tile_cols)
+{
+    sched->height = height;
+    sched->width = width;
+    sched->tile_rows = tile_rows;
+    sched->tile_cols = tile_cols;
+    sched->tiles_y = (height + tile_rows - 1) / tile_rows;
+    sched->tiles_x = (width + tile_cols - 1) / tile_cols;
+    sched->nthreads = nthreads;
+    sched->reverse = reverse;
+    sched->queues = (tile_queue_t *) aligned_alloc(64, nthreads * sizeof(tile_queue_t));
+
+    // contiguous runs keep each thread on neighboring tiles
+    int count = sched->tiles_y * sched->tiles_x;
+    for (int t = 0; t < nthreads; t++) {
+        uint32_t head = (uint32_t) ((long) count * t / nthreads);
+        uint32_t tail = (uint32_t) ((long) count * (t + 1) / nthreads);
+        sched->queues[t].range = pack_range(head, tail);
+    }
+}
+
+void tile_sched_free(tile_sched_t *sched)
+{
+    free(sched->queues);
+    sched->queues = NULL;
+}
+
+static void tile_bounds(tile_sched_t *sched, uint32_t idx, tile_t *tile)
+{
+    int count = sched->tiles_y * sched->tiles_x;
+    int t = sched->reverse ? count - 1 - (int) idx : (int) idx;
+    int ty = t / sched->tiles_x;
+    int tx = t % sched->tiles_x;
+
+    tile->y_begin = ty * sched->tile_rows;
+    tile->y_end = min(tile->y_begin + sched->tile_rows, sched->height);
+    tile->x_begin = tx * sched->tile_cols;
+    tile->x_end = min(tile->x_begin + sched->tile_cols, sched->width);
+}
+
+// take the front tile of queue q
+static bool pop_front(tile_queue_t *q, uint32_t *idx)
+{
+    uint64_t r = __atomic_load_n(&q->range, __ATOMIC_ACQUIRE);
+
+    while (range_head(r) < range_tail(r)) {
+        uint64_t next = pack_range(range_head(r) + 1, range_tail(r));
+        if (__atomic_compare_exchange_n(&q->range, &r, next, false, 
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *idx = range_head(r);
+            return true;
+        }
+    }
+    return false;
+}
+
+// move the back half of victim's queue into the empty queue own
+static bool steal_half(tile_queue_t *victim, tile_queue_t *own, uint32_t *idx)
+{
+    uint64_t r = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+
+    while (range_head(r) < range_tail(r)) {
+        uint32_t take = (range_tail(r) - range_head(r) + 1) / 2;
+        uint32_t first = range_tail(r) - take;
+        uint64_t next = pack_range(range_head(r), first);
+        if (__atomic_compare_exchange_n(&victim->range, &r, next, false, 
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(&own->range, pack_range(first + 1, first + take), 
+                __ATOMIC_RELEASE);
+            *idx = first;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool tile_sched_next(tile_sched_t *sched, int tid, tile_t *tile)
+{
+    tile_queue_t *own = &sched->queues[tid];
+    uint32_t idx;
+
+    if (pop_front(own, &idx)) {
+        tile_bounds(sched, idx, tile);
+        return true;
+    }
+
+    for (int k = 1; k < sched->nthreads; k++) {
+        tile_queue_t *victim = &sched->queues[(tid + k) % sched->nthreads];
+        if (steal_half(victim, own, &idx)) {
+            tile_bounds(sched, idx, tile);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,52 @@
+#ifndef TILES_H_
+#define TILES_H_
+
+#include <stdint.h>
+
+// default tile size, rows by columns
+#ifndef TILE_ROWS
+#define TILE_ROWS 32
+#endif
+#ifndef TILE_COLS
+#define TILE_COLS 64
+#endif
+
+typedef struct {
+    int y_begin;
+    int y_end;
+    int x_begin;
+    int x_end;
+} tile_t;
+
+// one thread's deque of tile indices, [head, tail) packed in one word and 
+// padded to its own cache line
+typedef struct {
+    uint64_t range;
+    char pad[56];
+} tile_queue_t;
+
+/**
+ * Work stealing tile scheduler. The tiles are split into one contiguous 
+ * run per thread, a thread takes tiles from the front of its own run and 
+ * once that is empty steals the back half of another thread's run.
+ */
+typedef struct {
+    int height;
+    int width;
+    int tile_rows;
+    int tile_cols;
+    int tiles_y;
+    int tiles_x;
+    int nthreads;
+    bool reverse;       // hand out tiles bottom-right first
+    tile_queue_t *queues;
+} tile_sched_t;
+
+void tile_sched_init(tile_sched_t *sched, int height, int width, int nthreads, 
+    bool reverse = false, int tile_rows = TILE_ROWS, int tile_cols = TILE_COLS);
+void tile_sched_free(tile_sched_t *sched);
+
+// next tile for thread tid, false once every tile has been handed out
+bool tile_sched_next(tile_sched_t *sched, int tid, tile_t *tile);
+
+#endif
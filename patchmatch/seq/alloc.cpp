@@ -0,0 +1,216 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if OMP
+#include "omp.h"
+#endif
+
+#include "alloc.h"
+
+#if OMP
+static inline int thread_num() { return omp_get_thread_num(); }
+static inline int num_threads() { return omp_get_num_threads(); }
+#else
+static inline int thread_num() { return 0; }
+static inline int num_threads() { return 1; }
+#endif
+
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+// the mapping's base and size sit in the page before the buffer
+#define BUFFER_HEADER 4096
+
+typedef struct {
+    char *base;
+    size_t size;
+} buffer_header_t;
+
+// a single node host, or a kernel without NUMA, just keeps the default
+static void interleave_pages(void *buf, size_t bytes)
+{
+    #ifdef SYS_mbind
+    unsigned long nodes = ~0UL;
+    syscall(SYS_mbind, buf, bytes, MPOL_INTERLEAVE, &nodes, sizeof(nodes) * 8, 0);
+    #endif
+}
+
+void *buffer_alloc(size_t bytes, placement_t place)
+{
+    bool huge = bytes >= HUGE_PAGE_SIZE;
+    size_t align = huge ? HUGE_PAGE_SIZE : BUFFER_HEADER;
+
+    // room for the header and for sliding the buffer up to the alignment
+    size_t size = bytes + BUFFER_HEADER + (huge ? HUGE_PAGE_SIZE : 0);
+    char *base = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, 
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "buffer_alloc: mapping %zu bytes failed\n", size);
+        exit(-1);
+    }
+
+    uintptr_t start = (uintptr_t) base + BUFFER_HEADER;
+    char *buf = (char *) ((start + align - 1) & ~(uintptr_t) (align - 1));
+
+    buffer_header_t *header = (buffer_header_t *) (buf - BUFFER_HEADER);
+    header->base = base;
+    header->size = size;
+
+    // without THP support this fails and the buffer keeps normal pages
+    #ifdef MADV_HUGEPAGE
+    if (huge) {
+        madvise(buf, (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1), MADV_HUGEPAGE);
+    }
+    #endif
+
+    if (place == PLACE_INTERLEAVE) {
+        interleave_pages(buf, bytes);
+    }
+
+    return buf;
+}
+
+void buffer_free(void *buf)
+{
+    if (buf == NULL) return;
+
+    buffer_header_t *header = (buffer_header_t *) ((char *) buf - BUFFER_HEADER);
+    munmap(header->base, header->size);
+}
+
+static inline size_t round_up(size_t bytes, size_t align)
+{
+    return (bytes + align - 1) & ~(align - 1);
+}
+
+void arena_init(arena_t *arena)
+{
+    arena->base = NULL;
+    arena->capacity = 0;
+    arena->used = 0;
+}
+
+void arena_reserve(arena_t *arena, size_t bytes)
+{
+    arena->used = 0;
+    if (bytes <= arena->capacity) return;
+
+    buffer_free(arena->base);
+    arena->base = (char *) buffer_alloc(bytes);
+    arena->capacity = bytes;
+}
+
+/**
+ * Interleaved allocations get whole pages of their own, the policy applies 
+ * to pages and would otherwise spill onto the neighbours. It only affects 
+ * pages not faulted in yet, a reused block keeps where its pages went.
+ */
+void *arena_alloc(arena_t *arena, size_t bytes, placement_t place)
+{
+    size_t align = (place == PLACE_INTERLEAVE) ? BUFFER_HEADER : ARENA_ALIGN;
+    size_t start = round_up(arena->used, align);
+    size_t end = round_up(start + bytes, align);
+    if (end > arena->capacity) {
+        fprintf(stderr, "arena_alloc: %zu bytes do not fit, %zu of %zu are taken\n", 
+            bytes, arena->used, arena->capacity);
+        exit(-1);
+    }
+
+    char *buf = arena->base + start;
+    arena->used = end;
+    if (place == PLACE_INTERLEAVE) {
+        interleave_pages(buf, end - start);
+    }
+    return buf;
+}
+
+size_t arena_bytes(size_t bytes, placement_t place)
+{
+    if (place == PLACE_INTERLEAVE) {
+        // worst case padding up to the page
+        return round_up(bytes, BUFFER_HEADER) + BUFFER_HEADER - ARENA_ALIGN;
+    }
+    return round_up(bytes, ARENA_ALIGN);
+}
+
+void arena_rewind(arena_t *arena, size_t mark)
+{
+    if (mark < arena->used) arena->used = mark;
+}
+
+void arena_release(arena_t *arena)
+{
+    buffer_free(arena->base);
+    arena_init(arena);
+}
+
+/**
+ * Sums AnonHugePages over the mappings of /proc/self/smaps that overlap 
+ * the range. A buffer_alloc block is a mapping of its own, so this counts 
+ * its huge pages and nobody else's.
+ */
+size_t huge_page_bytes(const void *buf, size_t bytes)
+{
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (f == NULL) return 0;
+
+    uintptr_t begin = (uintptr_t) buf;
+    uintptr_t end = begin + bytes;
+    bool inside = false;
+    char line[512];
+    size_t total_kb = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long map_begin, map_end;
+        size_t kb;
+        // mapping headers start with the address range, fields with a name
+        if (sscanf(line, "%lx-%lx ", &map_begin, &map_end) == 2) {
+            inside = map_begin < end && begin < map_end;
+        }
+        else if (inside && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            total_kb += kb;
+        }
+    }
+    fclose(f);
+    return total_kb * 1024;
+}
+
+/**
+ * Spread assumes the usual Linux numbering where each socket's cores are 
+ * contiguous, so evenly spaced threads cover every socket.
+ */
+void bind_threads(bind_policy_t policy)
+{
+    if (policy == BIND_NONE) return;
+
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    int cpus[CPU_SETSIZE];
+    int ncpus = 0;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &allowed)) cpus[ncpus++] = c;
+    }
+    if (ncpus == 0) return;
+
+    #if OMP
+    #pragma omp parallel
+    #endif
+    {
+        int t = thread_num();
+        int n = num_threads();
+        int k = (policy == BIND_CLOSE) ? t % ncpus : (int) ((long) t * ncpus / n) % ncpus;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[k], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+}
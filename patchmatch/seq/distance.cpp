@@ -0,0 +1,625 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "util.h"
+#include "distance.h"
+
+using namespace std;
+
+// keep the per-target helpers inside the patch kernels
+#define KERNEL_INLINE static inline __attribute__((always_inline))
+
+static inline float square(float x) { return x * x; }
+
+float sum_squared_diff(float *fpixel, float *spixel)
+{
+    float dist = 
+        square(fpixel[0] - spixel[0]) +
+        square(fpixel[1] - spixel[1]) +
+        square(fpixel[2] - spixel[2]);
+    return dist;
+}
+
+float sum_absolute_diff(float *fpixel, float *spixel)
+{
+    float dist = sqrt(
+        abs(fpixel[0] - spixel[0]) +
+        abs(fpixel[1] - spixel[1]) +
+        abs(fpixel[2] - spixel[2])
+    );
+    return dist;
+}
+
+/**
+ * Kernels for each instruction set. Pixels are padded to N_CHANNELS = 4 
+ * elements with a zero last channel (see mat_to_array), so a float pixel is 
+ * exactly one SSE register and the vector kernels can sum all four lanes.
+ */
+
+namespace dist_scalar {
+
+KERNEL_INLINE ssd_t pixel_ssd(const pixel_t *a, const pixel_t *b)
+{
+    ssd_t d0 = pixel_value(a[0]) - pixel_value(b[0]);
+    ssd_t d1 = pixel_value(a[1]) - pixel_value(b[1]);
+    ssd_t d2 = pixel_value(a[2]) - pixel_value(b[2]);
+    return d0 * d0 + d1 * d1 + d2 * d2;
+}
+
+KERNEL_INLINE ssd_t row_ssd(const pixel_t *a, const pixel_t *b, int n)
+{
+    ssd_t dist = 0;
+    for (int i = 0; i < n; i++) {
+        dist += pixel_ssd(a + i * N_CHANNELS, b + i * N_CHANNELS);
+    }
+    return dist;
+}
+
+KERNEL_INLINE ssd_t col_ssd(const pixel_t *a, int a_stride, 
+    const pixel_t *b, int b_stride, int n)
+{
+    ssd_t dist = 0;
+    for (int j = 0; j < n; j++) {
+        dist += pixel_ssd(a + (size_t) j * a_stride, b + (size_t) j * b_stride);
+    }
+    return dist;
+}
+
+#include "distance_kernels.h"
+
+}
+
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+namespace dist_sse4 {
+
+#if PIXEL_TYPE == PIXEL_U8
+
+#include "distance_u8.h"
+
+// four pixels per instruction
+KERNEL_INLINE ssd_t row_ssd(const pixel_t *a, const pixel_t *b, int n)
+{
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc = _mm_add_epi32(acc, ssd_epu8(
+            _mm_loadu_si128((const __m128i *) (a + i * N_CHANNELS)), 
+            _mm_loadu_si128((const __m128i *) (b + i * N_CHANNELS))));
+    }
+    for (; i < n; i++) {
+        acc = _mm_add_epi32(acc, pixel_ssd_epu8(a + i * N_CHANNELS, b + i * N_CHANNELS));
+    }
+    return hsum_epi32(acc);
+}
+
+// four rows per instruction, one pixel of each
+KERNEL_INLINE ssd_t col_ssd(const pixel_t *a, int a_stride, 
+    const pixel_t *b, int b_stride, int n)
+{
+    __m128i acc = _mm_setzero_si128();
+    int j = 0;
+    for (; j + 4 <= n; j += 4) {
+        const pixel_t *a1 = a + (size_t) j * a_stride;
+        const pixel_t *b1 = b + (size_t) j * b_stride;
+        __m128i va = _mm_setr_epi32(pixel_bits(a1), pixel_bits(a1 + a_stride), 
+            pixel_bits(a1 + 2 * a_stride), pixel_bits(a1 + 3 * a_stride));
+        __m128i vb = _mm_setr_epi32(pixel_bits(b1), pixel_bits(b1 + b_stride), 
+            pixel_bits(b1 + 2 * b_stride), pixel_bits(b1 + 3 * b_stride));
+        acc = _mm_add_epi32(acc, ssd_epu8(va, vb));
+    }
+    for (; j < n; j++) {
+        acc = _mm_add_epi32(acc, 
+            pixel_ssd_epu8(a + (size_t) j * a_stride, b + (size_t) j * b_stride));
+    }
+    return hsum_epi32(acc);
+}
+
+#else
+// widen one stored pixel to four floats
+KERNEL_INLINE __m128 load_pixel(const pixel_t *p)
+{
+    #if PIXEL_TYPE == PIXEL_F16
+    // no F16C at this level
+    return _mm_setr_ps(half_to_float(p[0]), half_to_float(p[1]), 
+        half_to_float(p[2]), half_to_float(p[3]));
+    #elif PIXEL_TYPE == PIXEL_BF16
+    return _mm_castsi128_ps(_mm_slli_epi32(
+        _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *) p)), 16));
+    #else
+    return _mm_loadu_ps(p);
+    #endif
+}
+
+KERNEL_INLINE float hsum128(__m128 v)
+{
+    v = _mm_hadd_ps(v, v);
+    v = _mm_hadd_ps(v, v);
+    return _mm_cvtss_f32(v);
+}
+
+KERNEL_INLINE float pixel_ssd(const pixel_t *a, const pixel_t *b)
+{
+    __m128 d = _mm_sub_ps(load_pixel(a), load_pixel(b));
+    return _mm_cvtss_f32(_mm_dp_ps(d, d, 0xF1));
+}
+
+// one pixel per instruction
+KERNEL_INLINE float row_ssd(const pixel_t *a, const pixel_t *b, int n)
+{
+    __m128 acc = _mm_setzero_ps();
+    for (int i = 0; i < n; i++) {
+        __m128 d = _mm_sub_ps(load_pixel(a + i * N_CHANNELS), 
+            load_pixel(b + i * N_CHANNELS));
+        acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+    }
+    return hsum128(acc);
+}
+
+KERNEL_INLINE float col_ssd(const pixel_t *a, int a_stride, 
+    const pixel_t *b, int b_stride, int n)
+{
+    __m128 acc = _mm_setzero_ps();
+    for (int j = 0; j < n; j++) {
+        __m128 d = _mm_sub_ps(load_pixel(a + (size_t) j * a_stride), 
+            load_pixel(b + (size_t) j * b_stride));
+        acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+    }
+    return hsum128(acc);
+}
+
+#endif
+
+#include "distance_kernels.h"
+
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#if PIXEL_TYPE == PIXEL_F16
+#pragma GCC target("avx2,fma,f16c")
+#else
+#pragma GCC target("avx2,fma")
+#endif
+namespace dist_avx2 {
+
+#if PIXEL_TYPE == PIXEL_U8
+
+#include "distance_u8.h"
+
+KERNEL_INLINE __m256i ssd_epu8_256(__m256i a, __m256i b)
+{
+    __m256i d = _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a));
+    __m256i lo = _mm256_unpacklo_epi8(d, _mm256_setzero_si256());
+    __m256i hi = _mm256_unpackhi_epi8(d, _mm256_setzero_si256());
+    return _mm256_add_epi32(_mm256_madd_epi16(lo, lo), _mm256_madd_epi16(hi, hi));
+}
+
+KERNEL_INLINE __m128i fold_256(__m256i v)
+{
+    return _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+// eight pixels per instruction, the rest four and then one at a time
+KERNEL_INLINE ssd_t row_ssd(const pixel_t *a, const pixel_t *b, int n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc = _mm256_add_epi32(acc, ssd_epu8_256(
+            _mm256_loadu_si256((const __m256i *) (a + i * N_CHANNELS)), 
+            _mm256_loadu_si256((const __m256i *) (b + i * N_CHANNELS))));
+    }
+    __m128i acc4 = fold_256(acc);
+    if (i + 4 <= n) {
+        acc4 = _mm_add_epi32(acc4, ssd_epu8(
+            _mm_loadu_si128((const __m128i *) (a + i * N_CHANNELS)), 
+            _mm_loadu_si128((const __m128i *) (b + i * N_CHANNELS))));
+        i += 4;
+    }
+    for (; i < n; i++) {
+        acc4 = _mm_add_epi32(acc4, pixel_ssd_epu8(a + i * N_CHANNELS, b + i * N_CHANNELS));
+    }
+    return hsum_epi32(acc4);
+}
+
+// eight rows per instruction, one pixel of each
+KERNEL_INLINE ssd_t col_ssd(const pixel_t *a, int a_stride, 
+    const pixel_t *b, int b_stride, int n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        const pixel_t *a1 = a + (size_t) j * a_stride;
+        const pixel_t *b1 = b + (size_t) j * b_stride;
+        __m256i va = _mm256_setr_epi32(pixel_bits(a1), pixel_bits(a1 + a_stride), 
+            pixel_bits(a1 + 2 * a_stride), pixel_bits(a1 + 3 * a_stride), 
+            pixel_bits(a1 + 4 * a_stride), pixel_bits(a1 + 5 * a_stride), 
+            pixel_bits(a1 + 6 * a_stride), pixel_bits(a1 + 7 * a_stride));
+        __m256i vb = _mm256_setr_epi32(pixel_bits(b1), pixel_bits(b1 + b_stride), 
+            pixel_bits(b1 + 2 * b_stride), pixel_bits(b1 + 3 * b_stride), 
+            pixel_bits(b1 + 4 * b_stride), pixel_bits(b1 + 5 * b_stride), 
+            pixel_bits(b1 + 6 * b_stride), pixel_bits(b1 + 7 * b_stride));
+        acc = _mm256_add_epi32(acc, ssd_epu8_256(va, vb));
+    }
+    __m128i acc4 = fold_256(acc);
+    for (; j < n; j++) {
+        acc4 = _mm_add_epi32(acc4, 
+            pixel_ssd_epu8(a + (size_t) j * a_stride, b + (size_t) j * b_stride));
+    }
+    return hsum_epi32(acc4);
+}
+
+#else
+KERNEL_INLINE __m128 load_pixel(const pixel_t *p)
+{
+    #if PIXEL_TYPE == PIXEL_F16
+    return _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *) p));
+    #elif PIXEL_TYPE == PIXEL_BF16
+    return _mm_castsi128_ps(_mm_slli_epi32(
+        _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *) p)), 16));
+    #else
+    return _mm_loadu_ps(p);
+    #endif
+}
+
+// two stored pixels as eight floats
+KERNEL_INLINE __m256 load_pixels2(const pixel_t *p)
+{
+    #if PIXEL_TYPE == PIXEL_F16
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) p));
+    #elif PIXEL_TYPE == PIXEL_BF16
+    return _mm256_castsi256_ps(_mm256_slli_epi32(
+        _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) p)), 16));
+    #else
+    return _mm256_loadu_ps(p);
+    #endif
+}
+
+KERNEL_INLINE float hsum128(__m128 v)
+{
+    v = _mm_hadd_ps(v, v);
+    v = _mm_hadd_ps(v, v);
+    return _mm_cvtss_f32(v);
+}
+
+KERNEL_INLINE float pixel_ssd(const pixel_t *a, const pixel_t *b)
+{
+    __m128 d = _mm_sub_ps(load_pixel(a), load_pixel(b));
+    return hsum128(_mm_mul_ps(d, d));
+}
+
+// two pixels per instruction, odd pixel handled with a 128 bit tail
+KERNEL_INLINE float row_ssd(const pixel_t *a, const pixel_t *b, int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m256 d = _mm256_sub_ps(load_pixels2(a + i * N_CHANNELS), 
+            load_pixels2(b + i * N_CHANNELS));
+        acc = _mm256_fmadd_ps(d, d, acc);
+    }
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), 
+        _mm256_extractf128_ps(acc, 1));
+    if (i < n) {
+        __m128 d = _mm_sub_ps(load_pixel(a + i * N_CHANNELS), 
+            load_pixel(b + i * N_CHANNELS));
+        acc4 = _mm_fmadd_ps(d, d, acc4);
+    }
+    return hsum128(acc4);
+}
+
+KERNEL_INLINE float col_ssd(const pixel_t *a, int a_stride, 
+    const pixel_t *b, int b_stride, int n)
+{
+    __m128 acc = _mm_setzero_ps();
+    for (int j = 0; j < n; j++) {
+        __m128 d = _mm_sub_ps(load_pixel(a + (size_t) j * a_stride), 
+            load_pixel(b + (size_t) j * b_stride));
+        acc = _mm_fmadd_ps(d, d, acc);
+    }
+    return hsum128(acc);
+}
+
+#endif
+
+#include "distance_kernels.h"
+
+}
+#pragma GCC pop_options
+
+// gcc 12 headers trip -Wmaybe-uninitialized on the 512 bit intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC push_options
+#if PIXEL_TYPE == PIXEL_U8
+#pragma GCC target("avx512f,avx512bw,fma")
+#elif PIXEL_TYPE == PIXEL_F16
+#pragma GCC target("avx512f,fma,f16c")
+#else
+#pragma GCC target("avx512f,fma")
+#endif
+namespace dist_avx512 {
+
+#if PIXEL_TYPE == PIXEL_U8
+
+#include "distance_u8.h"
+
+KERNEL_INLINE __m512i ssd_epu8_512(__m512i a, __m512i b)
+{
+    __m512i d = _mm512_or_si512(_mm512_subs_epu8(a, b), _mm512_subs_epu8(b, a));
+    __m512i lo = _mm512_unpacklo_epi8(d, _mm512_setzero_si512());
+    __m512i hi = _mm512_unpackhi_epi8(d, _mm512_setzero_si512());
+    return _mm512_add_epi32(_mm512_madd_epi16(lo, lo), _mm512_madd_epi16(hi, hi));
+}
+
+// sixteen pixels per instruction, the tail is a masked load
+KERNEL_INLINE ssd_t row_ssd(const pixel_t *a, const pixel_t *b, int n)
+{
+    __m512i acc = _mm512_setzero_si512();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm512_add_epi32(acc, ssd_epu8_512(
+            _mm512_loadu_si512(a + i * N_CHANNELS), _mm512_loadu_si512(b + i * N_CHANNELS)));
+    }
+    if (i < n) {
+        __mmask64 m = (__mmask64) ((1ULL << ((n - i) * N_CHANNELS)) - 1);
+        acc = _mm512_add_epi32(acc, ssd_epu8_512(
+            _mm512_maskz_loadu_epi8(m, a + i * N_CHANNELS), 
+            _mm512_maskz_loadu_epi8(m, b + i * N_CHANNELS)));
+    }
+    return _mm512_reduce_add_epi32(acc);
+}
+
+// sixteen rows per instruction, gathered one pixel of each
+KERNEL_INLINE ssd_t col_ssd(const pixel_t *a, int a_stride, 
+    const pixel_t *b, int b_stride, int n)
+{
+    __m512i rows = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i a_offsets = _mm512_mullo_epi32(rows, _mm512_set1_epi32(a_stride));
+    __m512i b_offsets = _mm512_mullo_epi32(rows, _mm512_set1_epi32(b_stride));
+    __m512i acc = _mm512_setzero_si512();
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m512i va = _mm512_i32gather_epi32(a_offsets, a + (size_t) j * a_stride, 1);
+        __m512i vb = _mm512_i32gather_epi32(b_offsets, b + (size_t) j * b_stride, 1);
+        acc = _mm512_add_epi32(acc, ssd_epu8_512(va, vb));
+    }
+    ssd_t dist = _mm512_reduce_add_epi32(acc);
+    for (; j < n; j++) {
+        dist += pixel_ssd(a + (size_t) j * a_stride, b + (size_t) j * b_stride);
+    }
+    return dist;
+}
+
+#else
+KERNEL_INLINE __m128 load_pixel(const pixel_t *p)
+{
+    #if PIXEL_TYPE == PIXEL_F16
+    return _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *) p));
+    #elif PIXEL_TYPE == PIXEL_BF16
+    return _mm_castsi128_ps(_mm_slli_epi32(
+        _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *) p)), 16));
+    #else
+    return _mm_loadu_ps(p);
+    #endif
+}
+
+#if PIXEL_TYPE == PIXEL_F16 || PIXEL_TYPE == PIXEL_BF16
+KERNEL_INLINE __m512 widen_pixels4(__m256i v)
+{
+    #if PIXEL_TYPE == PIXEL_F16
+    return _mm512_cvtph_ps(v);
+    #else
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(v), 16));
+    #endif
+}
+#endif
+
+// four stored pixels as sixteen floats
+KERNEL_INLINE __m512 load_pixels4(const pixel_t *p)
+{
+    #if PIXEL_TYPE == PIXEL_F16 || PIXEL_TYPE == PIXEL_BF16
+    return widen_pixels4(_mm256_loadu_si256((const __m256i *) p));
+    #else
+    return _mm512_loadu_ps(p);
+    #endif
+}
+
+// the first count of four pixels, the rest zero
+KERNEL_INLINE __m512 load_pixels4_partial(const pixel_t *p, int count)
+{
+    #if PIXEL_TYPE == PIXEL_F16 || PIXEL_TYPE == PIXEL_BF16
+    // two elements per 32 bit lane
+    __mmask16 m = (__mmask16) ((1u << (count * N_CHANNELS / 2)) - 1);
+    return widen_pixels4(_mm512_castsi512_si256(_mm512_maskz_loadu_epi32(m, p)));
+    #else
+    __mmask16 m = (__mmask16) ((1u << (count * N_CHANNELS)) - 1);
+    return _mm512_maskz_loadu_ps(m, p);
+    #endif
+}
+
+KERNEL_INLINE float hsum128(__m128 v)
+{
+    v = _mm_hadd_ps(v, v);
+    v = _mm_hadd_ps(v, v);
+    return _mm_cvtss_f32(v);
+}
+
+KERNEL_INLINE float pixel_ssd(const pixel_t *a, const pixel_t *b)
+{
+    __m128 d = _mm_sub_ps(load_pixel(a), load_pixel(b));
+    return hsum128(_mm_mul_ps(d, d));
+}
+
+// four pixels per instruction, the tail is a masked load
+KERNEL_INLINE float row_ssd(const pixel_t *a, const pixel_t *b, int n)
+{
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m512 d = _mm512_sub_ps(load_pixels4(a + i * N_CHANNELS), 
+            load_pixels4(b + i * N_CHANNELS));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    if (i < n) {
+        __m512 d = _mm512_sub_ps(load_pixels4_partial(a + i * N_CHANNELS, n - i), 
+            load_pixels4_partial(b + i * N_CHANNELS, n - i));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    acc = _mm512_add_ps(acc, _mm512_shuffle_f32x4(acc, acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm512_add_ps(acc, _mm512_shuffle_f32x4(acc, acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    return hsum128(_mm512_castps512_ps128(acc));
+}
+
+// four rows per instruction, gathered into one register
+KERNEL_INLINE float col_ssd(const pixel_t *a, int a_stride, 
+    const pixel_t *b, int b_stride, int n)
+{
+    __m512 acc = _mm512_setzero_ps();
+    int j = 0;
+    for (; j + 4 <= n; j += 4) {
+        const pixel_t *a1 = a + (size_t) j * a_stride;
+        const pixel_t *b1 = b + (size_t) j * b_stride;
+        __m512 va = _mm512_castps128_ps512(load_pixel(a1));
+        va = _mm512_insertf32x4(va, load_pixel(a1 + a_stride), 1);
+        va = _mm512_insertf32x4(va, load_pixel(a1 + 2 * a_stride), 2);
+        va = _mm512_insertf32x4(va, load_pixel(a1 + 3 * a_stride), 3);
+        __m512 vb = _mm512_castps128_ps512(load_pixel(b1));
+        vb = _mm512_insertf32x4(vb, load_pixel(b1 + b_stride), 1);
+        vb = _mm512_insertf32x4(vb, load_pixel(b1 + 2 * b_stride), 2);
+        vb = _mm512_insertf32x4(vb, load_pixel(b1 + 3 * b_stride), 3);
+        __m512 d = _mm512_sub_ps(va, vb);
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    acc = _mm512_add_ps(acc, _mm512_shuffle_f32x4(acc, acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm512_add_ps(acc, _mm512_shuffle_f32x4(acc, acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    __m128 acc4 = _mm512_castps512_ps128(acc);
+    for (; j < n; j++) {
+        __m128 d = _mm_sub_ps(load_pixel(a + (size_t) j * a_stride), 
+            load_pixel(b + (size_t) j * b_stride));
+        acc4 = _mm_fmadd_ps(d, d, acc4);
+    }
+    return hsum128(acc4);
+}
+
+#endif
+
+#include "distance_kernels.h"
+
+}
+#pragma GCC pop_options
+#pragma GCC diagnostic pop
+
+
+typedef float (*patch_ssd_fn)(const pixel_t *, int, const pixel_t *, int, 
+    int, int, int, int, int);
+typedef float (*patch_ssd_bounded_fn)(const pixel_t *, int, const pixel_t *, int, 
+    int, int, int, int, float, long *, int);
+typedef float (*patch_ssd_shift_fn)(const pixel_t *, int, const pixel_t *, int, 
+    int, int, int, int, float, int, int, int);
+typedef void (*patch_ssd_batch_fn)(const pixel_t *, int, const pixel_t *, int, 
+    int, int, const int *, const int *, int, int, int, float, float *, long *, int);
+
+typedef struct {
+    patch_ssd_fn patch;
+    patch_ssd_bounded_fn bounded;
+    patch_ssd_shift_fn shift;
+    patch_ssd_batch_fn batch;
+} dist_kernels_t;
+
+#define KERNELS(ns, hp) { \
+    ns::patch_ssd<hp>, ns::patch_ssd_bounded<hp>, ns::patch_ssd_shift<hp>, \
+    ns::patch_ssd_batch<hp> }
+
+// indexed by half patch, sizes without a specialization use the generic one
+#define SIZE_TABLE(ns) { \
+    KERNELS(ns, 0), KERNELS(ns, 1), KERNELS(ns, 2), KERNELS(ns, 3), \
+    KERNELS(ns, 4), KERNELS(ns, 5), KERNELS(ns, 0), KERNELS(ns, 7), \
+    KERNELS(ns, 0), KERNELS(ns, 0), KERNELS(ns, 10) }
+
+static const dist_kernels_t isa_kernels[ISA_COUNT][MAX_SPECIALIZED_PATCH + 1] = {
+    SIZE_TABLE(dist_scalar),
+    SIZE_TABLE(dist_sse4),
+    SIZE_TABLE(dist_avx2),
+    SIZE_TABLE(dist_avx512),
+};
+
+static const char *isa_names[ISA_COUNT] = { "scalar", "sse4", "avx2", "avx512" };
+
+static dist_isa_t cur_isa = ISA_SCALAR;
+static const dist_kernels_t *cur_kernels = isa_kernels[ISA_SCALAR];
+
+// sizes outside the table, negative ones included, take the generic kernel
+static inline const dist_kernels_t &kernels(int half_patch)
+{
+    bool specialized = (unsigned) half_patch <= MAX_SPECIALIZED_PATCH;
+    return cur_kernels[specialized ? half_patch : 0];
+}
+
+static dist_isa_t detect_isa()
+{
+    __builtin_cpu_init();
+    // the 8 bit kernels also need the byte and word instructions, half 
+    // floats are widened with F16C
+    bool bw = PIXEL_TYPE != PIXEL_U8 || __builtin_cpu_supports("avx512bw");
+    bool f16c = PIXEL_TYPE != PIXEL_F16 || __builtin_cpu_supports("f16c");
+    if (__builtin_cpu_supports("avx512f") && bw && f16c) return ISA_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && f16c) return ISA_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return ISA_SSE4;
+    return ISA_SCALAR;
+}
+
+void distance_init()
+{
+    cur_isa = detect_isa();
+    cur_kernels = isa_kernels[cur_isa];
+}
+
+dist_isa_t distance_isa() { return cur_isa; }
+
+const char *distance_isa_name() { return isa_names[cur_isa]; }
+
+bool distance_specialized(int half_patch)
+{
+    return half_patch > 0 && half_patch <= MAX_SPECIALIZED_PATCH && 
+        kernels(half_patch).patch != kernels(0).patch;
+}
+
+// the kernels index from data, which a tile's copy places at its origin
+float patch_distance(const image_t *first, const image_t *second, 
+    int fx, int fy, int sx, int sy, int half_patch)
+{
+    return kernels(half_patch).patch(first->data, first->stride, second->data, second->stride, 
+        fx - first->x0, fy - first->y0, sx - second->x0, sy - second->y0, half_patch);
+}
+
+float patch_distance_bounded(const image_t *first, const image_t *second, 
+    int fx, int fy, int sx, int sy, float bound, 
+    int half_patch, long *cut_short)
+{
+    return kernels(half_patch).bounded(first->data, first->stride, second->data, second->stride, 
+        fx - first->x0, fy - first->y0, sx - second->x0, sy - second->y0, 
+        bound, cut_short, half_patch);
+}
+
+float patch_distance_shift(const image_t *first, const image_t *second, 
+    int fx, int fy, int sx, int sy, float prev_dist, int dx, int dy, 
+    int half_patch)
+{
+    return kernels(half_patch).shift(first->data, first->stride, second->data, second->stride, 
+        fx - first->x0, fy - first->y0, sx - second->x0, sy - second->y0, 
+        prev_dist, dx, dy, half_patch);
+}
+
+void patch_distance_batch(const image_t *first, const image_t *second, 
+    int fx, int fy, const int *sx, const int *sy, int n, float bound, 
+    float *dist, int half_patch, long *cut_short)
+{
+    kernels(half_patch).batch(first->data, first->stride, second->data, second->stride, 
+        fx - first->x0, fy - first->y0, sx, sy, second->x0, second->y0, n, 
+        bound, dist, cut_short, half_patch);
+}
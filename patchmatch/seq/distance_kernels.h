@@ -0,0 +1,147 @@
+// Patch kernels shared by every instruction set. This file is included by 
+// distance.cpp once per target, inside a namespace that already provides
+//   ssd_t row_ssd(const pixel_t *a, const pixel_t *b, int n)
+//   ssd_t col_ssd(const pixel_t *a, int a_stride, 
+//       const pixel_t *b, int b_stride, int n)
+// where row_ssd covers n consecutive pixels of N_CHANNELS elements each and 
+// col_ssd covers n pixels of each that are a_stride and b_stride apart.
+//
+// The patch kernels are templates on the patch radius HP. With HP > 0 every 
+// trip count is a compile time constant and the loops unroll completely, 
+// HP = 0 is the generic version that reads the radius from half_patch. 
+// Every image has its own row stride, a tile's copy of the target is 
+// narrower than the source. Each carries a halo of at least the radius 
+// (see image.h), so no patch row or column needs clamping.
+
+// pixel (x, y) of an image whose rows are stride elements apart, x and y 
+// may reach into the halo
+KERNEL_INLINE const pixel_t *pixel_at(const pixel_t *img, int x, int y, int stride)
+{
+    return img + (ptrdiff_t) y * stride + x * N_CHANNELS;
+}
+
+// the patch rows through (fx, fy) and (sx, sy)
+KERNEL_INLINE ssd_t patch_row_ssd(const pixel_t *first, int fstride, 
+    const pixel_t *second, int sstride, int fx, int fy, int sx, int sy, int half_patch)
+{
+    return row_ssd(pixel_at(first, fx - half_patch, fy, fstride), 
+        pixel_at(second, sx - half_patch, sy, sstride), 2 * half_patch + 1);
+}
+
+// the patch columns through (fx, fy) and (sx, sy)
+KERNEL_INLINE ssd_t patch_col_ssd(const pixel_t *first, int fstride, 
+    const pixel_t *second, int sstride, int fx, int fy, int sx, int sy, int half_patch)
+{
+    return col_ssd(pixel_at(first, fx, fy - half_patch, fstride), fstride, 
+        pixel_at(second, sx, sy - half_patch, sstride), sstride, 2 * half_patch + 1);
+}
+
+template <int HP>
+static float patch_ssd(const pixel_t *first, int fstride, const pixel_t *second, int sstride, 
+    int fx, int fy, int sx, int sy, int half_patch)
+{
+    if (HP > 0) half_patch = HP;
+
+    ssd_t dist = 0;
+    for (int j = -half_patch; j <= half_patch; j++) {
+        dist += patch_row_ssd(first, fstride, second, sstride, 
+            fx, fy + j, sx, sy + j, half_patch);
+    }
+    return dist;
+}
+
+// stop after the first row that takes the partial sum to bound or above
+template <int HP>
+static float patch_ssd_bounded(const pixel_t *first, int fstride, 
+    const pixel_t *second, int sstride, 
+    int fx, int fy, int sx, int sy, float bound, long *cut_short, int half_patch)
+{
+    if (HP > 0) half_patch = HP;
+
+    ssd_t dist = 0;
+    for (int j = -half_patch; j <= half_patch; j++) {
+        dist += patch_row_ssd(first, fstride, second, sstride, 
+            fx, fy + j, sx, sy + j, half_patch);
+
+        if (dist >= bound) {
+            if (j < half_patch) (*cut_short)++;
+            break;
+        }
+    }
+    return dist;
+}
+
+/**
+ * Both patches moved by (dx, dy), one of which is +-1 and the other 0, 
+ * since prev_dist was computed. Drop the row or column that left the 
+ * window and add the one that entered it. The previous pair was centered 
+ * in the images, so the row or column that left lies within the halo.
+ */
+template <int HP>
+static float patch_ssd_shift(const pixel_t *first, int fstride, 
+    const pixel_t *second, int sstride, 
+    int fx, int fy, int sx, int sy, float prev_dist, int dx, int dy, int half_patch)
+{
+    if (HP > 0) half_patch = HP;
+
+    ssd_t leaving, entering;
+
+    if (dx != 0) {
+        leaving = patch_col_ssd(first, fstride, second, sstride, 
+            fx - dx * (half_patch + 1), fy, sx - dx * (half_patch + 1), sy, half_patch);
+        entering = patch_col_ssd(first, fstride, second, sstride, 
+            fx + dx * half_patch, fy, sx + dx * half_patch, sy, half_patch);
+    }
+    else {
+        leaving = patch_row_ssd(first, fstride, second, sstride, 
+            fx, fy - dy * (half_patch + 1), sx, sy - dy * (half_patch + 1), half_patch);
+        entering = patch_row_ssd(first, fstride, second, sstride, 
+            fx, fy + dy * half_patch, sx, sy + dy * half_patch, half_patch);
+    }
+
+    // rounding accumulates along a propagation chain, never go negative
+    return max(0.0f, prev_dist - leaving + entering);
+}
+
+/**
+ * Candidates (sx[k] - sx0, sy[k] - sy0), k < n <= PATCH_BATCH, scored for 
+ * the patch at (fx, fy) together, row by row. Each target row is read once 
+ * for all of them and stays in L1, and the candidate rows are independent 
+ * loads that are in flight at the same time. A candidate stops at the first 
+ * row that takes it to bound or above, as in patch_ssd_bounded, and the 
+ * batch stops once all of them have.
+ */
+template <int HP>
+static void patch_ssd_batch(const pixel_t *first, int fstride, 
+    const pixel_t *second, int sstride, int fx, int fy, 
+    const int *sx, const int *sy, int sx0, int sy0, int n, 
+    float bound, float *dist, long *cut_short, int half_patch)
+{
+    if (HP > 0) half_patch = HP;
+
+    ssd_t acc[PATCH_BATCH];
+    bool done[PATCH_BATCH];
+    int live = n;
+    for (int k = 0; k < n; k++) {
+        acc[k] = 0;
+        done[k] = false;
+    }
+
+    for (int j = -half_patch; j <= half_patch && live > 0; j++) {
+        for (int k = 0; k < n; k++) {
+            if (done[k]) continue;
+
+            acc[k] += patch_row_ssd(first, fstride, second, sstride, 
+                fx, fy + j, sx[k] - sx0, sy[k] - sy0 + j, half_patch);
+            if (acc[k] >= bound) {
+                if (j < half_patch) (*cut_short)++;
+                done[k] = true;
+                live--;
+            }
+        }
+    }
+
+    for (int k = 0; k < n; k++) {
+        dist[k] = acc[k];
+    }
+}
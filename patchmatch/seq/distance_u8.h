@@ -0,0 +1,46 @@
+// 8 bit pixel helpers shared by the SSE4.1, AVX2 and AVX-512 kernels. 
+// This file is included by distance.cpp inside each of those namespaces 
+// when PIXEL_TYPE is PIXEL_U8, so every copy is compiled for that 
+// namespace's target. It provides
+//   __m128i ssd_epu8(__m128i a, __m128i b)
+//   ssd_t hsum_epi32(__m128i v)
+//   ssd_t pixel_ssd(const pixel_t *a, const pixel_t *b)
+// and the wider targets build their row_ssd and col_ssd tails on them.
+
+// a whole 8 bit pixel as one 32 bit lane
+KERNEL_INLINE int pixel_bits(const pixel_t *p)
+{
+    int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * Squared differences of 16 bytes summed into 4 lanes. |a - b| is taken 
+ * on the bytes with two saturating subtractions, then widened to 16 bits 
+ * and squared and added in pairs by madd.
+ */
+KERNEL_INLINE __m128i ssd_epu8(__m128i a, __m128i b)
+{
+    __m128i d = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+    __m128i lo = _mm_unpacklo_epi8(d, _mm_setzero_si128());
+    __m128i hi = _mm_unpackhi_epi8(d, _mm_setzero_si128());
+    return _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi));
+}
+
+KERNEL_INLINE ssd_t hsum_epi32(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(v);
+}
+
+KERNEL_INLINE __m128i pixel_ssd_epu8(const pixel_t *a, const pixel_t *b)
+{
+    return ssd_epu8(_mm_cvtsi32_si128(pixel_bits(a)), _mm_cvtsi32_si128(pixel_bits(b)));
+}
+
+KERNEL_INLINE ssd_t pixel_ssd(const pixel_t *a, const pixel_t *b)
+{
+    return hsum_epi32(pixel_ssd_epu8(a, b));
+}
@@ -0,0 +1,84 @@
+#include <string.h>
+
+#include "image.h"
+
+static inline size_t align_up(size_t bytes)
+{
+    return (bytes + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+// elements from the start of a row to its pixel 0
+static inline int image_lead(int pad)
+{
+    return align_up((size_t) pad * N_CHANNELS * sizeof(pixel_t)) / sizeof(pixel_t);
+}
+
+static inline int image_stride(int width, int pad)
+{
+    size_t row_bytes = image_lead(pad) * sizeof(pixel_t)
+        + (size_t) (width + pad) * N_CHANNELS * sizeof(pixel_t);
+    return align_up(row_bytes) / sizeof(pixel_t);
+}
+
+size_t image_bytes(int height, int width, int pad)
+{
+    return (size_t) (height + 2 * pad) * image_stride(width, pad) * sizeof(pixel_t);
+}
+
+void image_wrap(image_t *img, void *buf, int height, int width, int pad)
+{
+    img->height = height;
+    img->width = width;
+    img->pad = pad;
+    img->stride = image_stride(width, pad);
+    img->x0 = 0;
+    img->y0 = 0;
+    img->data = (pixel_t *) buf + (size_t) pad * img->stride + image_lead(pad);
+}
+
+void image_fill_halo(image_t *img)
+{
+    int pad = img->pad;
+    int width = img->width;
+    size_t pixel_size = N_CHANNELS * sizeof(pixel_t);
+
+    if (pad == 0) return;
+
+    #if OMP
+    #pragma omp parallel for schedule(static)
+    #endif
+    for (int y = 0; y < img->height; y++) {
+        pixel_t *left = image_pixel(img, 0, y);
+        pixel_t *right = image_pixel(img, width - 1, y);
+        for (int i = 1; i <= pad; i++) {
+            memcpy(left - i * N_CHANNELS, left, pixel_size);
+            memcpy(right + i * N_CHANNELS, right, pixel_size);
+        }
+    }
+
+    // whole rows, halo columns included, so the corners follow
+    size_t row_size = (width + 2 * pad) * pixel_size;
+    pixel_t *top = image_pixel(img, -pad, 0);
+    pixel_t *bottom = image_pixel(img, -pad, img->height - 1);
+    for (int j = 1; j <= pad; j++) {
+        memcpy(top - (ptrdiff_t) j * img->stride, top, row_size);
+        memcpy(bottom + (ptrdiff_t) j * img->stride, bottom, row_size);
+    }
+}
+
+/**
+ * The copy reads the pad pixels around the tile from img, its neighbors or 
+ * its halo, so img's halo has to be at least pad wide and filled.
+ */
+void image_copy_tile(const image_t *img, image_t *tile, void *buf, 
+    int y_begin, int y_end, int x_begin, int x_end, int pad)
+{
+    image_wrap(tile, buf, y_end - y_begin, x_end - x_begin, pad);
+    tile->x0 = x_begin;
+    tile->y0 = y_begin;
+
+    size_t row_size = (tile->width + 2 * pad) * N_CHANNELS * sizeof(pixel_t);
+    for (int y = y_begin - pad; y < y_end + pad; y++) {
+        memcpy(image_pixel(tile, x_begin - pad, y), image_pixel(img, x_begin - pad, y), row_size);
+    }
+}
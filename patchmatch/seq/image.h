@@ -0,0 +1,63 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <stddef.h>
+
+#include "alloc.h"
+#include "pixel.h"
+
+/**
+ * Image with a halo of pad pixels on every side, each a copy of the
+ * nearest edge pixel. A patch of half size up to pad centered in the image
+ * reads the same pixels clamping its coordinates would, straight from
+ * memory. Rows are stride elements apart and pixel (0, y) of every row
+ * starts ARENA_ALIGN aligned.
+ *
+ * A tile's copy is an image of the tile's size at origin (x0, y0), 
+ * indexed with the coordinates of the image it was copied from.
+ */
+typedef struct {
+    pixel_t *data;  // pixel (x0, y0)
+    int height;
+    int width;
+    int pad;
+    int stride;
+    int x0;
+    int y0;
+} image_t;
+
+static inline pixel_t *image_pixel(const image_t *img, int x, int y)
+{
+    return img->data + (ptrdiff_t) (y - img->y0) * img->stride + (x - img->x0) * N_CHANNELS;
+}
+
+#define CACHE_LINE_SIZE 64
+
+// ask for the cache lines of the top rows of the patch around (x, y), the 
+// ones a bounded distance reads before it can stop
+static inline void image_prefetch_rows(const image_t *img, int x, int y, 
+    int half_patch, int rows)
+{
+    size_t row_bytes = (2 * half_patch + 1) * N_CHANNELS * sizeof(pixel_t);
+    if (rows > 2 * half_patch + 1) rows = 2 * half_patch + 1;
+    for (int j = 0; j < rows; j++) {
+        const char *row = (const char *) image_pixel(img, x - half_patch, y - half_patch + j);
+        for (size_t b = 0; b < row_bytes; b += CACHE_LINE_SIZE) {
+            __builtin_prefetch(row + b, 0, 3);
+        }
+        __builtin_prefetch(row + row_bytes - 1, 0, 3);
+    }
+}
+
+// bytes of an image with its halo
+size_t image_bytes(int height, int width, int pad);
+// lay an image out over buf of image_bytes(height, width, pad)
+void image_wrap(image_t *img, void *buf, int height, int width, int pad);
+// copy the edge pixels out into the halo, once the pixels are written
+void image_fill_halo(image_t *img);
+// copy rows [y_begin, y_end) x columns [x_begin, x_end) of img with a halo 
+// of pad pixels into tile, laid out over buf of image_bytes(rows, cols, pad)
+void image_copy_tile(const image_t *img, image_t *tile, void *buf, 
+    int y_begin, int y_end, int x_begin, int x_end, int pad);
+
+#endif
@@ -16,27 +16,42 @@ void display_image(string imgfile) {
     imshow(imgfile, img);
 }
 
+// stays 8 bit, mat_to_array converts to pixel_t while filling the arena
 void do_convert(const Mat &input, Mat &output, int width, int height)
 {
-    Mat tmp;
-    resize(input, tmp, Size(width, height));
-    tmp.convertTo(output, CV_32FC3);
+    if (input.cols == width && input.rows == height) {
+        output = input;
+    }
+    else {
+        resize(input, output, Size(width, height));
+    }
 }
 
-void undo_convert(const Mat &input, Mat &output, int width, int height)
+void undo_convert(const image_t *img, Mat &output, int width, int height, 
+    int out_width, int out_height)
 {
-    Mat tmp;
-    input.convertTo(tmp, CV_8UC3);
-    resize(tmp, output, Size(width, height));
+    Mat tmp(height, width, CV_8UC3);
+    array_to_mat(img->data, img->stride, tmp, height, width, 3);
+    if (width == out_width && height == out_height) {
+        output = tmp;
+    }
+    else {
+        resize(tmp, output, Size(out_width, out_height));
+    }
 }
 
+/**
+ * The source and target arrays and all of patchmatch()'s buffers come from 
+ * the arena, reserved once for the job. It is not freed here, so the next 
+ * job of the same size reuses the block without faulting in new pages.
+ */
 void do_patchmatch(string input_file, string src_file, string output_file, 
-    int width, int height, int half_patch) 
+    int width, int height, const pm_options_t *opt, arena_t *arena) 
 {
     Mat srcMat, srcMat2;
     Mat dstMat, dstMat2;
     Mat outputMat;
-    float *src, *dst;
+    image_t src, dst;
 
     srcMat = imread(src_file, IMREAD_COLOR);
     dstMat = imread(input_file, IMREAD_COLOR);
@@ -47,49 +62,85 @@ void do_patchmatch(string input_file, string src_file, string output_file,
     // #if DEBUG
     cout << "Width: " << width << endl;
     cout << "Height: " << height << endl;
-    cout << "HalfPatch: " << half_patch << endl;
+    cout << "HalfPatch: " << opt->half_patch << endl;
+    cout << "Seed: " << opt->seed << endl;
     // #endif
 
+    if (width > MAX_FIELD_DIM || height > MAX_FIELD_DIM) {
+        cout << "Images are limited to " << MAX_FIELD_DIM << " pixels a side" << endl;
+        return;
+    }
+
     do_convert(srcMat, srcMat2, width, height);
     do_convert(dstMat, dstMat2, width, height);
 
-    mat_to_array(srcMat2, &src);
-    mat_to_array(dstMat2, &dst);
+    // halos as wide as a patch reaches, patchmatch() fills them
+    int pad = opt->half_patch;
+    size_t bytes = image_bytes(height, width, pad);
+    arena_reserve(arena, arena_bytes(bytes, PLACE_LOCAL) + arena_bytes(bytes) 
+        + patchmatch_arena_size(height, width, opt));
+    image_wrap(&src, arena_alloc(arena, bytes, PLACE_LOCAL), height, width, pad);
+    image_wrap(&dst, arena_alloc(arena, bytes), height, width, pad);
+
+    mat_to_array(srcMat2, src.data, src.stride);
+    mat_to_array(dstMat2, dst.data, dst.stride);
 
     double t1 = currentSeconds();
-    patchmatch(src, dst, height, width, half_patch);
+    patchmatch(&src, &dst, height, width, opt, arena);
     double t2 = currentSeconds();
 
-    array_to_mat(dst, dstMat2, height, width, 3);
-
-    undo_convert(dstMat2, outputMat, dstMat.cols, dstMat.rows);
+    undo_convert(&dst, outputMat, width, height, dstMat.cols, dstMat.rows);
     imwrite(output_file, outputMat);
 
     double time_elasped = (t2 - t1);
     cout << "Time: "<< time_elasped << endl;
-
-    free(src);
-    free(dst);
 }
 
 static void usage(char *name) {
     string use_string = "-s SRC_FILE -i INPUT_FILE -o OUTPUT_FILE ";
-    use_string += "[-w WIDTH] [-h HEIGHT] [-p HALF_PATCH] [-t THREAD_COUNT]";
+    use_string += "[-w WIDTH] [-h HEIGHT] [-p HALF_PATCH] [--seed SEED]";
+    use_string += " [--levels LEVELS] [--fine-iters ITERATIONS] [--max-iters ITERATIONS]";
+    use_string += " [--converge FRACTION] [--time-budget SECONDS]";
+    use_string += " [--samples SAMPLES_PER_RADIUS] [--prefetch ROWS]";
+    use_string += " [--report-thp] [--repeat JOBS] [-t THREAD_COUNT]";
     cout << "Usage: " << name << " " << use_string << endl;
     exit(0);
 }
 
+// long options without a short form start after the char range
+enum { 
+    OPT_SEED = 256, OPT_LEVELS, OPT_FINE_ITERS, 
+    OPT_MAX_ITERS, OPT_CONVERGE, OPT_TIME_BUDGET, OPT_SAMPLES, OPT_PREFETCH, 
+    OPT_REPORT_THP, OPT_REPEAT
+};
+
+static struct option long_options[] = {
+    {"seed", required_argument, NULL, OPT_SEED},
+    {"levels", required_argument, NULL, OPT_LEVELS},
+    {"fine-iters", required_argument, NULL, OPT_FINE_ITERS},
+    {"max-iters", required_argument, NULL, OPT_MAX_ITERS},
+    {"converge", required_argument, NULL, OPT_CONVERGE},
+    {"time-budget", required_argument, NULL, OPT_TIME_BUDGET},
+    {"samples", required_argument, NULL, OPT_SAMPLES},
+    {"prefetch", required_argument, NULL, OPT_PREFETCH},
+    {"report-thp", no_argument, NULL, OPT_REPORT_THP},
+    {"repeat", required_argument, NULL, OPT_REPEAT},
+    {NULL, 0, NULL, 0}
+};
+
 int main(int argc, char** argv) {
     string input_file = "";
     string src_file = "";
     string output_file = "";
     int width = -1;
     int height = -1;
-    int half_patch = 1;
+    pm_options_t opt;
+    default_options(&opt);
+    int repeat = 1;
 
     int c;
     string optstring = "s:i:o:w:h:p:";
-    while ((c = getopt(argc, argv, optstring.c_str())) != -1) {
+    while ((c = getopt_long(argc, argv, optstring.c_str(), long_options, NULL)) != -1) {
         switch(c) {
             case 's':
                 src_file = optarg;
@@ -107,7 +158,37 @@ int main(int argc, char** argv) {
                 height = atoi(optarg);
                 break;
             case 'p':
-                half_patch = atoi(optarg);
+                opt.half_patch = atoi(optarg);
+                break;
+            case OPT_SEED:
+                opt.seed = strtoul(optarg, NULL, 0);
+                break;
+            case OPT_LEVELS:
+                opt.levels = atoi(optarg);
+                break;
+            case OPT_FINE_ITERS:
+                opt.fine_iterations = atoi(optarg);
+                break;
+            case OPT_MAX_ITERS:
+                opt.max_iterations = atoi(optarg);
+                break;
+            case OPT_CONVERGE:
+                opt.min_improvement = atof(optarg);
+                break;
+            case OPT_TIME_BUDGET:
+                opt.time_budget = atof(optarg);
+                break;
+            case OPT_SAMPLES:
+                opt.search_samples = atoi(optarg);
+                break;
+            case OPT_PREFETCH:
+                opt.prefetch_rows = atoi(optarg);
+                break;
+            case OPT_REPORT_THP:
+                opt.report_huge_pages = true;
+                break;
+            case OPT_REPEAT:
+                repeat = atoi(optarg);
                 break;
             default:
                 printf("Unknown option '%c'\n", c);
@@ -127,10 +208,24 @@ int main(int argc, char** argv) {
         cout << "Missing output file" << endl;
         usage(argv[0]);
     }
+    if (opt.half_patch < 0) {
+        cout << "Half patch must not be negative" << endl;
+        usage(argv[0]);
+    }
+    if (repeat < 1) {
+        cout << "Repeat needs at least one job" << endl;
+        usage(argv[0]);
+    }
 
     // display_image(src_file);
-    do_patchmatch(input_file, src_file, output_file, 
-        width, height, half_patch);
+    arena_t arena;
+    arena_init(&arena);
+    // jobs after the first reuse the arena's block
+    for (int r = 0; r < repeat; r++) {
+        do_patchmatch(input_file, src_file, output_file, 
+            width, height, &opt, &arena);
+    }
+    arena_release(&arena);
 
     return 0;
 }
\ No newline at end of file
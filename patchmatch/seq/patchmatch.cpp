@@ -5,6 +5,7 @@
 
 #include "util.h"
 #include "patchmatch.h"
+#include "rng.h"
 #include "cycletimer.h"
 
 using namespace cv;
@@ -15,52 +16,44 @@ inline int get_pidx(int y, int x, int w) { return y * w + x; }
 
 inline int get_cidx(int y, int x, int w, int c) { return (y * w + x) * N_CHANNELS + c; }
 
-inline float square(float x) { return x * x; }
-
-inline float sum_squared_diff(float *fpixel, float *spixel)
+// score a candidate, giving up once it cannot beat bound
+inline float candidate_distance(const image_t *first, const image_t *second, 
+    int fx, int fy, int sx, int sy, float bound, 
+    int half_patch, search_stats_t *stats)
 {
-    float dist = sqrt(
-        square(fpixel[0] - spixel[0]) +
-        square(fpixel[1] - spixel[1]) +
-        square(fpixel[2] - spixel[2])
-    );
-    return dist;
+    stats->evals++;
+    return patch_distance_bounded(first, second, fx, fy, sx, sy, bound, 
+        half_patch, &stats->cut_short);
 }
 
-inline float sum_absolute_diff(float *fpixel, float *spixel)
+// fold a pass's counters into the running ones
+inline void merge_stats(search_stats_t *stats, const search_stats_t *local)
 {
-    float dist = sqrt(
-        abs(fpixel[0] - spixel[0]) +
-        abs(fpixel[1] - spixel[1]) +
-        abs(fpixel[2] - spixel[2])
-    );
-    return dist;
+    if (!stats) return;
+
+    stats->evals += local->evals;
+    stats->cut_short += local->cut_short;
+    stats->improved += local->improved;
+    stats->dist_drop += local->dist_drop;
 }
 
-inline float patch_distance(float *first, float *second, 
-    int fx, int fy, int sx, int sy, 
-    int height, int width, int half_patch)
+
+void default_options(pm_options_t *opt)
 {
-    float dist = 0;
-    for (int j = -HALF_PATCH; j <= HALF_PATCH; j++) {
-        for (int i = -HALF_PATCH; i <= HALF_PATCH; i++) {
-            int fx1 = min(width - 1, max(0, fx + i));
-            int fy1 = min(height - 1, max(0, fy + i));
-            float *fpixel = first + get_pidx(fy1, fx1, width) * N_CHANNELS;
-
-            int sx1 = min(width - 1, max(0, sx + i));
-            int sy1 = min(height - 1, max(0, sy + i));
-            float *spixel = second + get_pidx(sy1, sx1, width) * N_CHANNELS;
-
-            dist += sum_squared_diff(fpixel, spixel);
-        }
-    }
-    return dist;
+    opt->half_patch = HALF_PATCH;
+    opt->seed = 0;
+    opt->levels = 0;
+    opt->fine_iterations = FINE_ITERATIONS;
+    opt->max_iterations = NUM_ITERATIONS;
+    opt->min_improvement = CONVERGENCE_THRESHOLD;
+    opt->time_budget = 0;
+    opt->search_samples = SEARCH_SAMPLES;
+    opt->prefetch_rows = PREFETCH_ROWS;
+    opt->report_huge_pages = false;
 }
 
-
 void pick_random_pixel(int radius, int height, int width, 
-    int sx, int sy, int *rx_ptr, int *ry_ptr)
+    int sx, int sy, rng_t *rng, int *rx_ptr, int *ry_ptr)
 {
     int xmin = max(sx - radius, 0);
     int xmax = min(sx + radius, width);
@@ -70,24 +63,103 @@ void pick_random_pixel(int radius, int height, int width,
     int xlen = xmax - xmin;
     int ylen = ymax - ymin;
 
-    *rx_ptr = (random() % xlen) + xmin;
-    *ry_ptr = (random() % ylen) + ymin;
+    *rx_ptr = rng_range(rng, xlen) + xmin;
+    *ry_ptr = rng_range(rng, ylen) + ymin;
+}
+
+/**
+ * Probe opt->search_samples random pixels in windows around the best match 
+ * whose radius halves from min(MAX_SEARCH_RADIUS, image size) down to 1. 
+ * Every probe is scored against the best distance so far.
+ */
+void random_search(const image_t *first, const image_t *second, int fx, int fy, 
+    int height, int width, const pm_options_t *opt, rng_t *rng, 
+    int *best_x, int *best_y, float *best_dist, search_stats_t *stats)
+{
+    int search_radius = min(MAX_SEARCH_RADIUS, max(width, height));
+
+    for (int radius = search_radius; radius >= 1; radius /= 2) {
+        for (int k = 0; k < opt->search_samples; k++) {
+            int rx, ry;
+            pick_random_pixel(radius, height, width, 
+                *best_x, *best_y, rng, &rx, &ry);
+            if (rx == *best_x && ry == *best_y) continue;
+
+            float dist = candidate_distance(first, second, fx, fy, rx, ry, 
+                *best_dist, opt->half_patch, stats);
+
+            if (dist < *best_dist) {
+                *best_x = rx;
+                *best_y = ry;
+                *best_dist = dist;
+            }
+        }
+    }
+}
+
+/**
+ * Scan direction of pass iter, 1 is top-left to bottom-right. Every other 
+ * pass runs backward and propagates from the right and lower neighbors, 
+ * so good matches spread both ways.
+ */
+static inline int scan_direction(int iter)
+{
+    return (iter % 2 == 0) ? -1 : 1;
+}
+
+/**
+ * Prefetch the top opt->prefetch_rows rows of the candidate pixel (fx, fy) 
+ * propagates from its upper neighbor, called a pixel ahead of the scan. 
+ * The candidate from its left neighbor is the match the scan is about to 
+ * pick, so it is not known yet.
+ */
+static inline void prefetch_propagated(const image_t *second, const map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, int fx, int fy)
+{
+    int dir = scan_direction(iter);
+    if (fx < 0 || fx >= width || fy - dir < 0 || fy - dir >= height) return;
+
+    int pf = (fy - dir) * width + fx;
+    int py = curMap->y[pf] + dir;
+    if (py >= 0 && py < height) {
+        image_prefetch_rows(second, curMap->x[pf], py, opt->half_patch, opt->prefetch_rows);
+    }
+}
+
+size_t map_bytes(int height, int width)
+{
+    size_t n = (size_t) height * width;
+    return 2 * arena_bytes(n * sizeof(uint16_t)) + arena_bytes(n * sizeof(dist_t));
+}
+
+void map_wrap(map_t *map, void *buf, int height, int width)
+{
+    size_t n = (size_t) height * width;
+    char *p = (char *) buf;
+
+    map->x = (uint16_t *) p;
+    p += arena_bytes(n * sizeof(uint16_t));
+    map->y = (uint16_t *) p;
+    p += arena_bytes(n * sizeof(uint16_t));
+    map->dist = (dist_t *) p;
 }
 
 // For each pixel in first, random assign a nn pixel in second
-void init_random_map(float *first, float *second, map_t *map, 
-    int height, int width, int half_patch)
+void init_random_map(const image_t *first, const image_t *second, map_t *map, 
+    int height, int width, const pm_options_t *opt)
 {
+    int half_patch = opt->half_patch;
+
     for (int y = 0; y < height; y++ ) {
         for (int x = 0; x < width; x++ ) {
-            int rx = random() % width;
-            int ry = random() % height;
             int idx = y * width + x;
+            rng_t rng;
+            rng_init(&rng, opt->seed, idx, 0);
+            int rx = rng_range(&rng, width);
+            int ry = rng_range(&rng, height);
 
-            map[idx].x = rx;
-            map[idx].y = ry;
-            map[idx].dist = patch_distance(first, second, x, y, rx, ry, 
-                height, width, half_patch);
+            set_entry(map, idx, rx, ry, patch_distance(first, second, x, y, rx, ry, 
+                half_patch));
         }
     }
 }
@@ -95,29 +167,48 @@ void init_random_map(float *first, float *second, map_t *map,
 /**
  * For each pixel in first, search for optimal nn pixel in second 
  */ 
-void nn_search(float *first, float *second, map_t *curMap, 
-    int height, int width, int half_patch)
+void nn_search(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, 
+    search_stats_t *stats)
 {
-    // int search_radius = min(MAX_SEARCH_RADIUS, min(width, height));
-    // int search_radius = max(width, height);
-    // int search_radius = min(5, max(width, height));
+    int half_patch = opt->half_patch;
+    search_stats_t local = {0, 0, 0, 0};
+
+    int dir = scan_direction(iter);
+    int y0 = (dir > 0) ? 0 : height - 1;
+    int x0 = (dir > 0) ? 0 : width - 1;
+
+    for (int j = 0; j < height; j++) {
+        int fy = y0 + dir * j;
 
-    for (int fy = 0; fy < height; fy++) {
-        for (int fx = 0; fx < width; fx++) {
+        for (int i = 0; i < width; i++) {
+            int fx = x0 + dir * i;
             int f = (fy * width) + fx;
-            int best_x = curMap[f].x; 
-            int best_y = curMap[f].y; 
-            float best_dist = curMap[f].dist;
+            if (opt->prefetch_rows > 0) {
+                prefetch_propagated(second, curMap, height, width, opt, iter, fx + dir, fy);
+            }
+
+            int best_x = curMap->x[f]; 
+            int best_y = curMap->y[f]; 
+            float best_dist = get_dist(curMap, f);
 
-            // propagate
-            if (fx > 0) {
+            // propagate from the neighbors already visited this pass, a 
+            // candidate equal to the best is not scored again, the shifted 
+            // distance would only add its rounding to the stored one
+            if (i > 0) {
                 // find neighbor's patch
-                int pf = f - 1;
-                int px = curMap[pf].x + 1;
-                int py = curMap[pf].y;
+                int pf = f - dir;
+                int px = curMap->x[pf] + dir;
+                int py = curMap->y[pf];
                 
-                if (px < width) { 
-                    float dist = patch_distance(first, second, fx, fy, px, py, height, width, half_patch);
+                if (px >= 0 && px < width && !(px == best_x && py == best_y)) { 
+                    #if INCREMENTAL_DISTANCE
+                    float dist = patch_distance_shift(first, second, fx, fy, px, py, 
+                        get_dist(curMap, pf), dir, 0, half_patch);
+                    #else
+                    float dist = candidate_distance(first, second, fx, fy, px, py, 
+                        best_dist, half_patch, &local);
+                    #endif
                     
                     if (dist < best_dist) {
                         best_x = px; 
@@ -127,14 +218,20 @@ void nn_search(float *first, float *second, map_t *curMap,
                 }
             }
 
-            if (fy > 0) {
+            if (j > 0) {
                 // find neighbor's patch
-                int pf = f - width;
-                int px = curMap[pf].x;
-                int py = curMap[pf].y + 1;
+                int pf = f - dir * width;
+                int px = curMap->x[pf];
+                int py = curMap->y[pf] + dir;
                 
-                if (py < height) { 
-                    float dist = patch_distance(first, second, fx, fy, px, py, height, width, half_patch);
+                if (py >= 0 && py < height && !(px == best_x && py == best_y)) { 
+                    #if INCREMENTAL_DISTANCE
+                    float dist = patch_distance_shift(first, second, fx, fy, px, py, 
+                        get_dist(curMap, pf), 0, dir, half_patch);
+                    #else
+                    float dist = candidate_distance(first, second, fx, fy, px, py, 
+                        best_dist, half_patch, &local);
+                    #endif
                     
                     if (dist < best_dist) {
                         best_x = px; 
@@ -145,55 +242,84 @@ void nn_search(float *first, float *second, map_t *curMap,
             }
 
             // random search
-            int radius = 15;
-            int rx, ry;
-            pick_random_pixel(radius, height, width, 
-                best_x, best_y, &rx, &ry);
+            rng_t rng;
+            rng_init(&rng, opt->seed, f, iter);
+            random_search(first, second, fx, fy, height, width, opt, &rng, 
+                &best_x, &best_y, &best_dist, &local);
+            
+            if (best_x != curMap->x[f] || best_y != curMap->y[f]) {
+                local.improved++;
+                local.dist_drop += get_dist(curMap, f) - best_dist;
+            }
 
-            float dist = patch_distance(first, second, fx, fy, rx, ry, height, width, half_patch);
+            set_entry(curMap, f, best_x, best_y, best_dist);
+        }
+    }
 
-            if (dist < best_dist) {
-                best_x = rx;
-                best_y = ry;
-                best_dist = dist;
-            }
-            
-            curMap[f].x = best_x;
-            curMap[f].y = best_y;
-            curMap[f].dist = best_dist;
+    merge_stats(stats, &local);
+}
+
+/**
+ * Seed a field from the one on the next coarser level. Each pixel takes 
+ * its parent's match scaled by two plus its own offset within the parent.
+ */
+void nn_upsample(const image_t *first, const image_t *second, map_t *coarse, map_t *fine, 
+    int coarse_height, int coarse_width, int height, int width, int half_patch)
+{
+    for (int y = 0; y < height; y++) {
+        int cy = min(y / 2, coarse_height - 1);
+
+        for (int x = 0; x < width; x++) {
+            int cx = min(x / 2, coarse_width - 1);
+            int parent = get_pidx(cy, cx, coarse_width);
+            int sx = min(width - 1, coarse->x[parent] * 2 + (x - cx * 2));
+            int sy = min(height - 1, coarse->y[parent] * 2 + (y - cy * 2));
+
+            set_entry(fine, get_pidx(y, x, width), sx, sy, 
+                patch_distance(first, second, x, y, sx, sy, half_patch));
         }
     }
 }
 
-void nn_map(float *src, float *dst, map_t *map,
+double nn_total_distance(map_t *map, int height, int width)
+{
+    double total = 0;
+    for (int f = 0; f < height * width; f++) {
+        total += get_dist(map, f);
+    }
+    return total;
+}
+
+void nn_map(const image_t *src, image_t *dst, map_t *map,
     int height, int width)
 {
     for (int dy = 0; dy < height; dy++) {
         for (int dx = 0; dx < width; dx++) {
             int idx = get_pidx(dy, dx, width);
 
-            if (map[idx].x < 0 || map[idx].x >= width) {
-                cout << "Bad X position " << map[idx].x 
+            if (map->x[idx] >= width) {
+                cout << "Bad X position " << map->x[idx] 
                     << " at (" << dx << ", " << dy << ")" << endl;
             }
-            else if (map[idx].y < 0 || map[idx].y >= height) {
-                cout << "Bad Y position " << map[idx].y 
+            else if (map->y[idx] >= height) {
+                cout << "Bad Y position " << map->y[idx] 
                     << " at (" << dx << ", " << dy << ")" << endl;
             }
             else {
-                int midx = get_pidx(map[idx].y, map[idx].x, width);
-                dst[idx * N_CHANNELS + 0] = src[midx * N_CHANNELS + 0];
-                dst[idx * N_CHANNELS + 1] = src[midx * N_CHANNELS + 1];
-                dst[idx * N_CHANNELS + 2] = src[midx * N_CHANNELS + 2];
+                const pixel_t *spixel = image_pixel(src, map->x[idx], map->y[idx]);
+                pixel_t *dpixel = image_pixel(dst, dx, dy);
+                dpixel[0] = spixel[0];
+                dpixel[1] = spixel[1];
+                dpixel[2] = spixel[2];
             }
         }
     }
 }
 
-void nn_map_average(float *src, float *dst, map_t *map, 
+void nn_map_average(const image_t *src, image_t *dst, map_t *map, 
     int height, int width, int half_patch)
 {
-    half_patch = max(1, HALF_PATCH / 2);
+    half_patch = max(1, half_patch / 2);
 
     for (int dy = 0; dy < height; dy++) {
         int fy_min = max(dy - half_patch, 0);
@@ -211,66 +337,230 @@ void nn_map_average(float *src, float *dst, map_t *map,
             for (int fy = fy_min; fy <= fy_max; fy++) {
                 for (int fx = fx_min; fx <= fx_max; fx++) {
                     int f = fy * width + fx;
-                    int px = map[f].x;
-                    int py = map[f].y;
+                    int px = map->x[f];
+                    int py = map->y[f];
 
-                    float *spixel = src + get_pidx(py, px, width) * N_CHANNELS;
-                    pixel_sums[0] += spixel[0];
-                    pixel_sums[1] += spixel[1];
-                    pixel_sums[2] += spixel[2];
+                    const pixel_t *spixel = image_pixel(src, px, py);
+                    pixel_sums[0] += pixel_value(spixel[0]);
+                    pixel_sums[1] += pixel_value(spixel[1]);
+                    pixel_sums[2] += pixel_value(spixel[2]);
                 }
             }
 
             int num_pixels = fy_len * fx_len;
 
-            float *dpixel = dst + get_pidx(dy, dx, width) * N_CHANNELS;
-            dpixel[0] = pixel_sums[0] / num_pixels;
-            dpixel[1] = pixel_sums[1] / num_pixels;
-            dpixel[2] = pixel_sums[2] / num_pixels;
+            pixel_t *dpixel = image_pixel(dst, dx, dy);
+            dpixel[0] = to_pixel(pixel_sums[0] / num_pixels);
+            dpixel[1] = to_pixel(pixel_sums[1] / num_pixels);
+            dpixel[2] = to_pixel(pixel_sums[2] / num_pixels);
+        }
+    }
+}
+
+// number of levels such that the coarsest keeps PYRAMID_MIN_SIZE pixels
+static int pyramid_levels(int height, int width, const pm_options_t *opt)
+{
+    int levels = 1;
+    int size = min(height, width);
+
+    while (levels < MAX_PYRAMID_LEVELS && size / 2 >= PYRAMID_MIN_SIZE) {
+        size /= 2;
+        levels++;
+    }
+    return opt->levels > 0 ? min(opt->levels, levels) : levels;
+}
+
+/**
+ * Level l > 0 of both pyramids, and two field slots the levels alternate 
+ * between: slot 0 for even levels, sized for level 0, and slot 1 for odd 
+ * levels, sized for level 1.
+ */
+size_t patchmatch_arena_size(int height, int width, const pm_options_t *opt)
+{
+    int levels = pyramid_levels(height, width, opt);
+    int pad = opt->half_patch;
+    size_t bytes = 0;
+    int h = height;
+    int w = width;
+
+    bytes += arena_bytes(map_bytes(h, w));
+    #if DEBUG
+    if (SAVE_ITER_OUTPUT) {
+        bytes += arena_bytes(image_bytes(h, w, pad));
+    }
+    #endif
+    for (int l = 1; l < levels; l++) {
+        h = (h + 1) / 2;
+        w = (w + 1) / 2;
+        size_t level_bytes = image_bytes(h, w, pad);
+        bytes += arena_bytes(level_bytes) + arena_bytes(level_bytes);
+        if (l == 1) {
+            bytes += arena_bytes(map_bytes(h, w));
         }
     }
+    return bytes;
 }
 
-void patchmatch(float *src, float *dst, int height, int width, int half_patch)
+/**
+ * Coarse to fine search. The coarsest level starts from a random field and 
+ * runs up to opt->max_iterations passes, every finer level starts from the 
+ * upsampled field of the level below and runs up to opt->fine_iterations. 
+ * A level stops early once a pass removes less than opt->min_improvement 
+ * of its total distance, and every level stops once the time budget is 
+ * spent, the remaining levels are then only upsampled.
+ */
+void patchmatch(image_t *src, image_t *dst, int height, int width, 
+    const pm_options_t *opt, arena_t *arena)
 {
-    double t1, time_init, time_search = 0, time_map;
-    map_t *curMap = (map_t *) malloc(height * width * sizeof(map_t));
+    int half_patch = opt->half_patch;
+    double t1, time_init = 0, time_search = 0, time_map;
+    search_stats_t stats = {0, 0, 0, 0};
+    map_t *curMap = NULL;
+    int iter = 0;
+
+    if (src->pad < half_patch || dst->pad < half_patch) {
+        cout << "Images need a halo of " << half_patch << " pixels" << endl;
+        return;
+    }
 
+    distance_init();
+    cout << "Distance kernel: " << distance_isa_name() 
+        << (distance_specialized(half_patch) ? "" : " (generic size)") << endl;
+
+    // level 0 is the full resolution image
+    int levels = pyramid_levels(height, width, opt);
+    image_t src_pyr[MAX_PYRAMID_LEVELS], dst_pyr[MAX_PYRAMID_LEVELS];
+    int heights[MAX_PYRAMID_LEVELS], widths[MAX_PYRAMID_LEVELS];
+
+    // everything below is carved from the arena and handed back at the end
+    size_t mark = arena->used;
+    map_t map_slots[2];
+    map_wrap(&map_slots[0], arena_alloc(arena, map_bytes(height, width)), height, width);
+    #if DEBUG
+    // sized for level 0, every level lays its image out over it
+    void *scratch_buf = SAVE_ITER_OUTPUT ? 
+        arena_alloc(arena, image_bytes(height, width, half_patch)) : NULL;
+    #endif
+
+    // the caller wrote the pixels, the halos are ours
     t1 = currentSeconds();
-    init_random_map(dst, src, curMap, height, width, half_patch);
-    time_init = currentSeconds() - t1;
+    image_fill_halo(src);
+    image_fill_halo(dst);
+    src_pyr[0] = *src;
+    dst_pyr[0] = *dst;
+    heights[0] = height;
+    widths[0] = width;
+    for (int l = 1; l < levels; l++) {
+        heights[l] = (heights[l - 1] + 1) / 2;
+        widths[l] = (widths[l - 1] + 1) / 2;
+        size_t level_bytes = image_bytes(heights[l], widths[l], half_patch);
+        image_wrap(&src_pyr[l], arena_alloc(arena, level_bytes), 
+            heights[l], widths[l], half_patch);
+        image_wrap(&dst_pyr[l], arena_alloc(arena, level_bytes), 
+            heights[l], widths[l], half_patch);
+        pyr_down_image(&src_pyr[l - 1], &src_pyr[l]);
+        pyr_down_image(&dst_pyr[l - 1], &dst_pyr[l]);
+    }
+    double time_pyramid = currentSeconds() - t1;
 
-    for (int i = 1; i <= NUM_ITERATIONS; i++) {
-        #if DEBUG
-        cout << "PATCHMATCH iteration " << i << endl;
-        #endif
+    if (levels > 1) {
+        map_wrap(&map_slots[1], arena_alloc(arena, map_bytes(heights[1], widths[1])), 
+            heights[1], widths[1]);
+    }
+
+    for (int l = levels - 1; l >= 0; l--) {
+        int h = heights[l];
+        int w = widths[l];
+        const image_t *src_l = &src_pyr[l];
+        const image_t *dst_l = &dst_pyr[l];
+        map_t *levelMap = &map_slots[l % 2];
+        // the slot is sized for the largest level it holds, lay it out for this one
+        map_wrap(levelMap, levelMap->x, h, w);
 
         t1 = currentSeconds();
-        nn_search(dst, src, curMap, height, width, half_patch);
-        time_search += currentSeconds() - t1;
-
-        #if DEBUG
-        if (SAVE_ITER_OUTPUT && (i % 4) == 0) {
-            char fname[64];
-            sprintf(fname, "../scratch/pm-iter-%i.jpg", i);
-            cout << fname << endl;
-
-            float *cur;
-            clone_array(dst, &cur, height, width);
-            nn_map_average(src, cur, curMap, height, width, half_patch);
-            imwrite_array(fname, cur, height, width, 3);
-            free(cur);
+        if (curMap == NULL) {
+            init_random_map(dst_l, src_l, levelMap, h, w, opt);
+        }
+        else {
+            nn_upsample(dst_l, src_l, curMap, levelMap, 
+                heights[l + 1], widths[l + 1], h, w, half_patch);
         }
-        #endif
+        curMap = levelMap;
+        time_init += currentSeconds() - t1;
+
+        int max_iterations = (l == levels - 1) ? opt->max_iterations : opt->fine_iterations;
+        double level_dist = nn_total_distance(curMap, h, w);
+        search_stats_t pass = {0, 0, 0, 0};
+        int i;
+
+        for (i = 1; i <= max_iterations; i++) {
+            if (opt->time_budget > 0 && time_search >= opt->time_budget) {
+                break;
+            }
+            iter++;
+
+            pass = {0, 0, 0, 0};
+            t1 = currentSeconds();
+            nn_search(dst_l, src_l, curMap, h, w, opt, iter, &pass);
+            time_search += currentSeconds() - t1;
+            merge_stats(&stats, &pass);
+
+            #if DEBUG
+            cout << "PATCHMATCH level " << l << " iteration " << i 
+                << ": improved " << pass.improved << " pixels, distance -" 
+                << (100.0 * pass.dist_drop / max(level_dist, 1.0)) << "%" << endl;
+            #endif
+
+            bool converged = pass.dist_drop < opt->min_improvement * level_dist;
+            level_dist -= pass.dist_drop;
+
+            #if DEBUG
+            if (SAVE_ITER_OUTPUT && (iter % 4) == 0) {
+                char fname[64];
+                sprintf(fname, "../scratch/pm-iter-%i.jpg", iter);
+                cout << fname << endl;
+
+                image_t scratch;
+                image_wrap(&scratch, scratch_buf, h, w, half_patch);
+                clone_image(dst_l, &scratch);
+                nn_map_average(src_l, &scratch, curMap, h, w, half_patch);
+                imwrite_image(fname, &scratch, 3);
+            }
+            #endif
+
+            if (converged) {
+                i++;
+                break;
+            }
+        }
+
+        cout << "Level " << l << ": " << (i - 1) << " passes, last improved " 
+            << pass.improved << " of " << (h * w) << " pixels" << endl;
     }
 
+    double total_dist = nn_total_distance(curMap, height, width);
+
+    // while the pyramid and the field are still allocated
+    size_t huge_bytes = opt->report_huge_pages ? 
+        huge_page_bytes(arena->base, arena->capacity) : 0;
+
     t1 = currentSeconds();
     nn_map_average(src, dst, curMap, height, width, half_patch);
     time_map = currentSeconds() - t1;
 
-    free(curMap);
+    arena_rewind(arena, mark);
 
+    cout << "Pyramid levels: " << levels << endl;
+    cout << "Search iterations: " << iter << endl;
+    cout << "Mean patch distance: " << (total_dist / (height * width)) << endl;
+    cout << "Time pyramid: "<< time_pyramid << endl;
     cout << "Time init: "<< time_init << endl;
-    cout << "Time search per iter: "<< (time_search / NUM_ITERATIONS) << endl;
+    cout << "Time search per iter: "<< (time_search / max(1, iter)) << endl;
     cout << "Time map: "<< time_map << endl;
+    cout << "Early exits: " << stats.cut_short << " of " << stats.evals 
+        << " evaluations (" << (100.0 * stats.cut_short / max(1L, stats.evals)) << "%)" << endl;
+    if (opt->report_huge_pages) {
+        cout << "Huge pages in the arena: " << (huge_bytes / HUGE_PAGE_SIZE) << " (" 
+            << (huge_bytes >> 20) << " MB)" << endl;
+    }
 }
\ No newline at end of file
@@ -1,41 +1,136 @@
 #ifndef PATCHMATCH_H_
 #define PATCHMATCH_H_
 
+#include <stdint.h>
+
+#include "alloc.h"
+#include "distance.h"
+
 #define NUM_ITERATIONS 10
+#define CONVERGENCE_THRESHOLD 0.001
+#define FINE_ITERATIONS 2
+#define MAX_PYRAMID_LEVELS 8
+#define PYRAMID_MIN_SIZE 64
 #define MAX_SEARCH_RADIUS 256
+#define SEARCH_SAMPLES 1
 #define SAVE_ITER_OUTPUT 0
 
+// default for --prefetch, top patch rows prefetched of each candidate 
+// known ahead of time, 0 turns prefetching off. Off by default, it only 
+// pays once the source image is well past the last level cache
+#ifndef PREFETCH_ROWS
+#define PREFETCH_ROWS 0
+#endif
+
+// score propagated candidates by updating the neighbor's distance
+#define INCREMENTAL_DISTANCE 1
+
+// default for -p, any size can be picked at runtime
 #ifndef HALF_PATCH
 #define HALF_PATCH 7
 #endif
 
-// map entry type
+// match coordinates are 16 bit, so images are at most this wide and tall
+#define MAX_FIELD_DIM 65536
+
+// store distances as bfloat16, IEEE half overflows at patch SSD magnitudes
+#define FIELD_BF16_DIST 0
+
+#if FIELD_BF16_DIST
+typedef uint16_t dist_t;
+// a rounded neighbor distance is no base for the incremental update
+#undef INCREMENTAL_DISTANCE
+#define INCREMENTAL_DISTANCE 0
+#else
+typedef float dist_t;
+#endif
+
+/**
+ * Nearest neighbor field as separate planes, pixel f matches 
+ * (x[f], y[f]) at distance dist[f]. The coordinate planes are all that 
+ * voting reads, at 4 bytes a pixel instead of 12.
+ */
 typedef struct {
-    int x;
-    int y;
-    float dist;
+    uint16_t *x;
+    uint16_t *y;
+    dist_t *dist;
 } map_t;
 
-// distance functions
-float sum_squared_diff(float *fpixel, float *spixel);
-float sum_absolute_diff(float *fpixel, float *spixel);
-float patch_distance(float *first, float *second, 
-    int fx, int fy, int sx, int sy, 
-    int height, int width, int half_patch = 1);
+static inline float get_dist(const map_t *map, int f)
+{
+    #if FIELD_BF16_DIST
+    return bf16_to_float(map->dist[f]);
+    #else
+    return map->dist[f];
+    #endif
+}
+
+static inline void set_dist(map_t *map, int f, float dist)
+{
+    #if FIELD_BF16_DIST
+    map->dist[f] = float_to_bf16(dist);
+    #else
+    map->dist[f] = dist;
+    #endif
+}
+
+static inline void set_entry(map_t *map, int f, int x, int y, float dist)
+{
+    map->x[f] = (uint16_t) x;
+    map->y[f] = (uint16_t) y;
+    set_dist(map, f, dist);
+}
+
+// bytes of a field's planes, each starting ARENA_ALIGN aligned
+size_t map_bytes(int height, int width);
+// lay a field's planes out over buf of map_bytes(height, width)
+void map_wrap(map_t *map, void *buf, int height, int width);
+
+// candidate evaluation counters
+typedef struct {
+    long evals;         // full patch evaluations against a bound
+    long cut_short;     // of those, stopped before the last patch row
+    long improved;      // pixels whose match changed to a better one
+    double dist_drop;   // total distance removed by those matches
+} search_stats_t;
+
+// runtime options
+typedef struct {
+    int half_patch;
+    uint32_t seed;      // with the pixel and iteration, keys every random draw
+    int levels;         // pyramid levels, 0 adds levels down to PYRAMID_MIN_SIZE
+    int fine_iterations;    // passes on each level above the coarsest
+    int max_iterations;     // passes on the coarsest level
+    double min_improvement; // stop a level once a pass removes less than
+                            // this fraction of its total distance
+    double time_budget;     // seconds of searching over all levels, 0 is unlimited
+    int search_samples;     // random probes per search radius
+    int prefetch_rows;      // top rows of each candidate patch prefetched
+    bool report_huge_pages;
+} pm_options_t;
+
+void default_options(pm_options_t *opt);
 
 // intialize nearest neighbor field
-void init_random_map(float *first, float *second, map_t *map, 
-    int height, int width, int half_patch = 1);
+void init_random_map(const image_t *first, const image_t *second, map_t *map, 
+    int height, int width, const pm_options_t *opt);
 
-// nearest neighbor field
-void nn_search(float *first, float *second, map_t *curMap, 
-    int height, int width, int half_patch = 1);
-void nn_map(float *src, float *dst, map_t *map,
+// nearest neighbor field, iter numbers the pass starting at 1
+void nn_search(const image_t *first, const image_t *second, map_t *curMap, 
+    int height, int width, const pm_options_t *opt, int iter, 
+    search_stats_t *stats = NULL);
+void nn_upsample(const image_t *first, const image_t *second, map_t *coarse, map_t *fine, 
+    int coarse_height, int coarse_width, int height, int width, int half_patch);
+double nn_total_distance(map_t *map, int height, int width);
+void nn_map(const image_t *src, image_t *dst, map_t *map,
     int height, int width);
-void nn_map_average(float *src, float *dst, map_t *map, 
+void nn_map_average(const image_t *src, image_t *dst, map_t *map, 
     int height, int width, int half_patch = 1);
 
-void patchmatch(float *src, float *dst, 
-    int height, int width, int half_patch = 1);
+// arena bytes patchmatch() takes on top of what the caller holds
+size_t patchmatch_arena_size(int height, int width, const pm_options_t *opt);
+// src and dst have a halo of at least opt->half_patch
+void patchmatch(image_t *src, image_t *dst, 
+    int height, int width, const pm_options_t *opt, arena_t *arena);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,132 @@
+#ifndef PIXEL_H_
+#define PIXEL_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+// element types of image arrays
+#define PIXEL_F32 0
+#define PIXEL_U8 1
+#define PIXEL_F16 2
+#define PIXEL_BF16 3
+
+// element type the search runs on, make PIXEL_TYPE=PIXEL_U8 picks 8 bit
+#ifndef PIXEL_TYPE
+#define PIXEL_TYPE PIXEL_F32
+#endif
+
+// pixels are padded to N_CHANNELS elements, the padding channel is zero
+#define N_CHANNELS 4
+
+/**
+ * 8 bit images take 4 bytes a pixel instead of 16. Their patch distances
+ * are summed in 32 bit integers, exact for half patches up to 51. The 16
+ * bit float types take 8 bytes a pixel and are widened to float in the
+ * kernels, for inputs that 8 bits would round too coarsely.
+ */
+#if PIXEL_TYPE == PIXEL_U8
+typedef uint8_t pixel_t;
+typedef int32_t ssd_t;
+#elif PIXEL_TYPE == PIXEL_F16 || PIXEL_TYPE == PIXEL_BF16
+typedef uint16_t pixel_t;
+typedef float ssd_t;
+#else
+typedef float pixel_t;
+typedef float ssd_t;
+#endif
+
+static inline uint8_t float_to_u8(float v)
+{
+    return (uint8_t) fminf(255.0f, fmaxf(0.0f, rintf(v)));
+}
+
+// bfloat16 is the upper half of a float
+static inline float bf16_to_float(uint16_t h)
+{
+    uint32_t bits = (uint32_t) h << 16;
+    float v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// round to nearest even
+static inline uint16_t float_to_bf16(float v)
+{
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return (uint16_t) (bits >> 16);
+}
+
+static inline float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+    uint32_t bits;
+
+    if (exp == 0) {
+        // zero or subnormal, mant * 2^-24
+        float v = mant * (1.0f / 16777216.0f);
+        return sign ? -v : v;
+    }
+    if (exp == 31) {
+        bits = sign | 0x7f800000 | (mant << 13);
+    }
+    else {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+
+    float v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+}
+
+// round to nearest even, too large values become infinity
+static inline uint16_t float_to_half(float v)
+{
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+
+    if (bits >= 0x477ff000) {
+        return sign | (bits > 0x7f800000 ? 0x7e00 : 0x7c00);
+    }
+    if (bits < 0x38800000) {
+        // below the smallest normal half
+        float a;
+        memcpy(&a, &bits, sizeof(a));
+        return sign | (uint16_t) rintf(a * 16777216.0f);
+    }
+    bits = bits - 0x38000000 + 0xfff + ((bits >> 13) & 1);
+    return sign | (uint16_t) (bits >> 13);
+}
+
+// value of a stored element, in the type distances are summed in
+static inline ssd_t pixel_value(pixel_t p)
+{
+    #if PIXEL_TYPE == PIXEL_F16
+    return half_to_float(p);
+    #elif PIXEL_TYPE == PIXEL_BF16
+    return bf16_to_float(p);
+    #else
+    return p;
+    #endif
+}
+
+static inline pixel_t to_pixel(float v)
+{
+    #if PIXEL_TYPE == PIXEL_U8
+    return float_to_u8(v);
+    #elif PIXEL_TYPE == PIXEL_F16
+    return float_to_half(v);
+    #elif PIXEL_TYPE == PIXEL_BF16
+    return float_to_bf16(v);
+    #else
+    return v;
+    #endif
+}
+
+#endif
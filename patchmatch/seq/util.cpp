@@ -4,51 +4,197 @@
 using namespace std;
 using namespace cv;
 
-void mat_to_array(const cv::Mat &mat, float **arr_ptr)
+/**
+ * Conversions of one array element by its PIXEL_* type, through float. 
+ * Stores round to nearest and the 8 bit one saturates.
+ */
+template <int E> struct elem_conv;
+
+template <> struct elem_conv<PIXEL_F32> {
+    typedef float type;
+    static float load(float v) { return v; }
+    static float store(float v) { return v; }
+};
+
+template <> struct elem_conv<PIXEL_U8> {
+    typedef uint8_t type;
+    static float load(uint8_t v) { return v; }
+    static uint8_t store(float v) { return float_to_u8(v); }
+};
+
+template <> struct elem_conv<PIXEL_F16> {
+    typedef uint16_t type;
+    static float load(uint16_t v) { return half_to_float(v); }
+    static uint16_t store(float v) { return float_to_half(v); }
+};
+
+template <> struct elem_conv<PIXEL_BF16> {
+    typedef uint16_t type;
+    static float load(uint16_t v) { return bf16_to_float(v); }
+    static uint16_t store(float v) { return float_to_bf16(v); }
+};
+
+template <typename T, int E>
+static void mat_to_array_typed(const cv::Mat &mat, void *out, int stride)
 {
+    typedef elem_conv<E> conv;
+    typename conv::type *arr = (typename conv::type *) out;
     int ny = mat.rows;
     int nx = mat.cols;
     int nc = mat.channels();
 
-    float *arr = (float *) malloc(ny * nx * N_CHANNELS * sizeof(float));
-    
+    // first touch, rows split like the kernels' static schedule
+    #if OMP
+    #pragma omp parallel for schedule(static)
+    #endif
     for (int y = 0; y < ny; y++) {
+        typename conv::type *row = arr + (size_t) y * stride;
         for (int x = 0; x < nx; x++) {
-            int idx = y * nx + x;
-            Vec3f pixel = mat.at<Vec3f>(y, x);
+            const T &pixel = mat.at<T>(y, x);
             for (int c = 0; c < nc; c++) {
-                arr[idx * N_CHANNELS + c] = pixel[c];
+                row[x * N_CHANNELS + c] = conv::store(pixel[c]);
+            }
+            for (int c = nc; c < N_CHANNELS; c++) {
+                row[x * N_CHANNELS + c] = 0;
             }
         }
     }
-    *arr_ptr = arr;
 }
 
-void array_to_mat(float *arr, cv::Mat &mat, int ny, int nx, int nc)
+template <int E>
+static void mat_to_array_elem(const cv::Mat &mat, void *arr, int stride)
+{
+    if (mat.type() == CV_8UC3) {
+        mat_to_array_typed<Vec3b, E>(mat, arr, stride);
+    }
+    else {
+        mat_to_array_typed<Vec3f, E>(mat, arr, stride);
+    }
+}
+
+void mat_to_array(const cv::Mat &mat, void *arr, int stride, int elem_type)
 {
+    switch (elem_type) {
+        case PIXEL_U8:
+            mat_to_array_elem<PIXEL_U8>(mat, arr, stride);
+            break;
+        case PIXEL_F16:
+            mat_to_array_elem<PIXEL_F16>(mat, arr, stride);
+            break;
+        case PIXEL_BF16:
+            mat_to_array_elem<PIXEL_BF16>(mat, arr, stride);
+            break;
+        default:
+            mat_to_array_elem<PIXEL_F32>(mat, arr, stride);
+    }
+}
+
+template <int E>
+static void array_to_mat_elem(const void *in, int stride, cv::Mat &mat, 
+    int ny, int nx, int nc)
+{
+    typedef elem_conv<E> conv;
+    const typename conv::type *arr = (const typename conv::type *) in;
+    bool bytes = mat.type() == CV_8UC3;
+
     for (int y = 0; y < ny; y++) {
         for (int x = 0; x < nx; x++) {
-            float *p = arr + (y * nx + x) * N_CHANNELS;
+            const typename conv::type *p = arr + (size_t) y * stride + x * N_CHANNELS;
             for (int c = 0; c < nc; c++) {
-                mat.at<Vec3f>(y, x)[c] = p[c];
+                float v = conv::load(p[c]);
+                if (bytes) {
+                    mat.at<Vec3b>(y, x)[c] = float_to_u8(v);
+                }
+                else {
+                    mat.at<Vec3f>(y, x)[c] = v;
+                }
             }
         }
     }
 }
 
-void clone_array(float *arr, float **out_ptr, int ny, int nx)
+void array_to_mat(const void *arr, int stride, cv::Mat &mat, int ny, int nx, int nc, 
+    int elem_type)
+{
+    switch (elem_type) {
+        case PIXEL_U8:
+            array_to_mat_elem<PIXEL_U8>(arr, stride, mat, ny, nx, nc);
+            break;
+        case PIXEL_F16:
+            array_to_mat_elem<PIXEL_F16>(arr, stride, mat, ny, nx, nc);
+            break;
+        case PIXEL_BF16:
+            array_to_mat_elem<PIXEL_BF16>(arr, stride, mat, ny, nx, nc);
+            break;
+        default:
+            array_to_mat_elem<PIXEL_F32>(arr, stride, mat, ny, nx, nc);
+    }
+}
+
+void clone_image(const image_t *img, image_t *out)
 {
-    size_t size = ny * nx * N_CHANNELS * sizeof(float);
-    float *new_arr = (float *) malloc(size);
-    memcpy(new_arr, arr, size);
-    *out_ptr = new_arr;
+    size_t row_size = img->width * N_CHANNELS * sizeof(pixel_t);
+
+    #if OMP
+    #pragma omp parallel for schedule(static)
+    #endif
+    for (int y = 0; y < img->height; y++) {
+        memcpy(image_pixel(out, 0, y), image_pixel(img, 0, y), row_size);
+    }
+    image_fill_halo(out);
 }
 
-void imwrite_array(string fname, float *arr, int ny, int nx, int nc)
+void imwrite_image(string fname, const image_t *img, int nc)
 {
-    Mat dst(ny, nx, CV_32FC3);
-    array_to_mat(arr, dst, ny, nx, nc);
-    Mat dst2;
-    dst.convertTo(dst2, CV_8UC3);
-    imwrite(fname, dst2);
-}
\ No newline at end of file
+    Mat dst(img->height, img->width, CV_8UC3);
+    array_to_mat(img->data, img->stride, dst, img->height, img->width, nc);
+    imwrite(fname, dst);
+}
+
+/**
+ * Blur and halve straight into out, pyrDown keeps a destination that 
+ * already has the right size and type and both Mats are headers with the 
+ * images' strides, so the halos are never read. It has no 16 bit float 
+ * path, those images are blurred as a widened copy and rounded back.
+ */
+void pyr_down_image(const image_t *img, image_t *out)
+{
+    int ny = img->height;
+    int nx = img->width;
+
+    #if PIXEL_TYPE == PIXEL_F16 || PIXEL_TYPE == PIXEL_BF16
+    Mat in(ny, nx, CV_32FC4);
+    Mat out_mat;
+
+    #if OMP
+    #pragma omp parallel for schedule(static)
+    #endif
+    for (int y = 0; y < ny; y++) {
+        const pixel_t *src = image_pixel(img, 0, y);
+        float *row = in.ptr<float>(y);
+        for (int k = 0; k < nx * N_CHANNELS; k++) {
+            row[k] = pixel_value(src[k]);
+        }
+    }
+
+    pyrDown(in, out_mat, Size(out->width, out->height));
+
+    #if OMP
+    #pragma omp parallel for schedule(static)
+    #endif
+    for (int y = 0; y < out->height; y++) {
+        pixel_t *dst = image_pixel(out, 0, y);
+        const float *row = out_mat.ptr<float>(y);
+        for (int k = 0; k < out->width * N_CHANNELS; k++) {
+            dst[k] = to_pixel(row[k]);
+        }
+    }
+    #else
+    int type = (PIXEL_TYPE == PIXEL_U8) ? CV_8UC4 : CV_32FC4;
+    Mat in(ny, nx, type, img->data, img->stride * sizeof(pixel_t));
+    Mat out_mat(out->height, out->width, type, out->data, out->stride * sizeof(pixel_t));
+    pyrDown(in, out_mat, out_mat.size());
+    #endif
+
+    image_fill_halo(out);
+}
@@ -3,15 +3,26 @@
 
 #include <opencv2/opencv.hpp>
 
+#include "alloc.h"
+#include "image.h"
+
 #ifndef DEBUG
 #define DEBUG 0
 #endif
 
-#define N_CHANNELS 4
-
-void mat_to_array(const cv::Mat &mat, float **arr_ptr);
-void array_to_mat(float *arr, cv::Mat &mat, int ny, int nx, int nc);
-void clone_array(float *arr, float **out_ptr, int ny, int nx);
-void imwrite_array(std::string fname, float *arr, int ny, int nx, int nc);
+/**
+ * Arrays live in caller provided buffers of ny rows, stride elements apart, 
+ * of nx * N_CHANNELS elements, usually an image carved from the job's 
+ * arena. Mats are CV_8UC3 or CV_32FC3. elem_type is the PIXEL_* type of 
+ * the array's elements, the search works on PIXEL_TYPE.
+ */
+void mat_to_array(const cv::Mat &mat, void *arr, int stride, 
+    int elem_type = PIXEL_TYPE);
+void array_to_mat(const void *arr, int stride, cv::Mat &mat, int ny, int nx, int nc, 
+    int elem_type = PIXEL_TYPE);
+void clone_image(const image_t *img, image_t *out);
+void imwrite_image(std::string fname, const image_t *img, int nc);
+// out is half the size of img, rounded up, its halo is filled too
+void pyr_down_image(const image_t *img, image_t *out);
 
 #endif
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <time.h>
 #include "omp.h"
 #include "cycletimer.h"
+#include "pool.h"
 using namespace std;
 #define ITERATIONS 40000
 #define THREAD_COUNT 8
@@ -528,6 +529,82 @@ void poisson_jacobi_omp_dynamic(float *targetimg, float *outimg,
        
 }
 
+struct jacobi_job{
+    float *targetimg;
+    float *outimg;
+    int *boundary_array;
+    int c, w, h;
+    int boundBoxMinX, boundBoxMinY;
+    int mask_width, mask_height;
+    int chunk_count;
+    int next_chunk[2];  // chunk counters, one per iteration parity
+};
+
+// same sweep as poisson_jacobi_omp_dynamic, chunks handed out by a counter
+void poisson_jacobi_pool_task(int t, int nthreads, void *arg){
+    jacobi_job *job = (jacobi_job *)arg;
+    int w = job->w;
+    int h = job->h;
+    int mask_size = job->mask_height*job->mask_width;
+
+    for(int i=0; i<ITERATIONS; i++){
+        int *next = &job->next_chunk[i%2];
+        int chunk;
+        while((chunk = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED)) < job->chunk_count){
+            int id_end = min((chunk+1)*CHUNKSIZE1, mask_size*job->c);
+            for(int id_fake = chunk*CHUNKSIZE1; id_fake<id_end; id_fake++){
+                int channel = id_fake/mask_size;
+                int y=(id_fake%mask_size)/job->mask_width + job->boundBoxMinY;
+                int x=(id_fake%mask_size)%job->mask_width + job->boundBoxMinX;
+
+                int id = x + y*w + channel * w * h;
+                int idx_nextX = x+1 + w*y +w*h*channel;
+                int idx_prevX = x-1 + w*y + w*h*channel;
+                int idx_nextY = x + w*(y+1) +w*h*channel;
+                int idx_prevY = x + w*(y-1) +w*h*channel;
+
+                if(job->boundary_array[id] == INSIDE_MASK){
+                    float *targetimg = job->targetimg;
+                    float *outimg = job->outimg;
+                    double neighbor_target = targetimg[idx_nextY]+targetimg[idx_nextX]+targetimg[idx_prevX]+targetimg[idx_prevY];
+                    double neighbor_output = outimg[idx_nextY]+outimg[idx_nextX]+outimg[idx_prevX]+outimg[idx_prevY];
+                    outimg[id] = 0.25*(4*targetimg[id]-neighbor_target + neighbor_output);
+                }
+            }
+        }
+        // nobody uses the other counter until after the barrier
+        if(t == 0){
+            job->next_chunk[(i+1)%2] = 0;
+        }
+        pool_barrier(t);
+    }
+}
+
+// dynamic version on the persistent pool, one pool barrier per iteration
+// instead of one parallel region
+void poisson_jacobi_pool(float *targetimg, float *outimg, 
+    int *boundary_array,int c, int w, 
+    int h, int boundBoxMinX, int boundBoxMaxX, 
+    int boundBoxMinY, int boundBoxMaxY){
+
+    jacobi_job job;
+    job.targetimg = targetimg;
+    job.outimg = outimg;
+    job.boundary_array = boundary_array;
+    job.c = c;
+    job.w = w;
+    job.h = h;
+    job.boundBoxMinX = boundBoxMinX;
+    job.boundBoxMinY = boundBoxMinY;
+    job.mask_width = boundBoxMaxX - boundBoxMinX+1;
+    job.mask_height = boundBoxMaxY - boundBoxMinY+1;
+    job.chunk_count = (job.mask_width*job.mask_height*c + CHUNKSIZE1-1)/CHUNKSIZE1;
+    job.next_chunk[0] = 0;
+    job.next_chunk[1] = 0;
+
+    pool_run(poisson_jacobi_pool_task, &job);
+}
+
 int main(int argc, char **argv)
 {
     
@@ -591,6 +668,7 @@ int main(int argc, char **argv)
     float *imgOut_openmp = new float[(size_t)target_w*target_h*mOut_seq.channels()];
     int *boundryPixelArray_openmp_dynamic = new int[(size_t)target_w*target_h*mOut_seq.channels()];
     float *imgOut_openmp_dynamic = new float[(size_t)target_w*target_h*mOut_seq.channels()];
+    float *imgOut_pool = new float[(size_t)target_w*target_h*mOut_seq.channels()];
     float *neighbor_sum_list = new float[(size_t)target_w*target_h*mOut_seq.channels()];
     
     /*---------sequential-----------*/
@@ -644,6 +722,21 @@ int main(int argc, char **argv)
     convert_layered_to_interleaved((float*)mOut_seq.data, imgOut_openmp_dynamic, source_w, source_h, source_nc);
     cv::imwrite("FinalImage_omp_dynamic.jpg",mOut_seq*255.f);
 
+    /*---------thread pool---------*/
+    pool_init(THREAD_COUNT);
+    merge_without_blend_omp_dynamic(srcimgIn, targetimgIn, imgOut_pool, boundryPixelArray_openmp_dynamic, source_nc, source_w, source_h);
+
+    double t4 = currentSeconds();
+    poisson_jacobi_pool(targetimgIn, imgOut_pool, boundryPixelArray_openmp_dynamic, source_nc, source_w, source_h, boundBoxMinX, boundBoxMaxX, boundBoxMinY, boundBoxMaxY);
+    double pool_time = currentSeconds()-t4;
+    pool_shutdown();
+
+    cout << "time cost for thread pool: "<<pool_time * 1000 << endl;
+    cout << "speedup for thread pool: "<<sequential_time /pool_time<<endl;
+
+    convert_layered_to_interleaved((float*)mOut_seq.data, imgOut_pool, source_w, source_h, source_nc);
+    cv::imwrite("FinalImage_pool.jpg",mOut_seq*255.f);
+
     free(srcimgIn);
     free(maskIn);
     free(targetimgIn);
@@ -653,6 +746,7 @@ int main(int argc, char **argv)
     free(imgOut_openmp);
     free(boundryPixelArray_openmp_dynamic);
     free(imgOut_openmp_dynamic);
+    free(imgOut_pool);
     free(neighbor_sum_list);
 
 } 
\ No newline at end of file
@@ -0,0 +1,186 @@
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+// spins before a waiting thread parks on the barrier's futex
+#define SPIN_LIMIT 4096
+
+typedef struct {
+    int sense;
+    char pad[60];
+} thread_sense_t;
+
+static struct {
+    int nthreads;
+    pthread_t *threads;
+    thread_sense_t *local_sense;
+    cpu_set_t allowed;      // the process's cores, the workers are pinned over them
+
+    // barrier state, count on its own line from the flipping sense
+    int count __attribute__((aligned(64)));
+    int sense __attribute__((aligned(64)));
+    int parked;     // threads asleep on sense, the release only wakes if any
+
+    pool_fn_t fn;
+    void *arg;
+    bool quit;
+} pool;
+
+static inline void futex_wait(int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void futex_wake(int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Spin until the barrier flips to sense, then sleep. Between jobs the 
+ * workers end up parked, so OpenMP regions run outside the pool do not 
+ * share the cores with threads that never block. parked is raised before 
+ * the futex rechecks sense and the release reads it after flipping sense, 
+ * both sequentially consistent, so a parking thread is never missed.
+ */
+static void wait_sense(int sense)
+{
+    int spins = 0;
+    while (__atomic_load_n(&pool.sense, __ATOMIC_ACQUIRE) != sense) {
+        if (++spins < SPIN_LIMIT) {
+            #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+            #endif
+            continue;
+        }
+        __atomic_add_fetch(&pool.parked, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&pool.sense, !sense);
+        __atomic_sub_fetch(&pool.parked, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void pool_barrier(int tid)
+{
+    int sense = !pool.local_sense[tid].sense;
+    pool.local_sense[tid].sense = sense;
+
+    // the last thread in resets the count and releases the others
+    if (__atomic_sub_fetch(&pool.count, 1, __ATOMIC_ACQ_REL) == 0) {
+        pool.count = pool.nthreads;
+        __atomic_store_n(&pool.sense, sense, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pool.parked, __ATOMIC_SEQ_CST) > 0) {
+            futex_wake(&pool.sense);
+        }
+    }
+    else {
+        wait_sense(sense);
+    }
+}
+
+/**
+ * Cores the process may run on, read at load time before main or OpenMP 
+ * binds any thread. By pool_init the caller may already be pinned to a 
+ * single core, and its own mask would put every worker there.
+ */
+static cpu_set_t process_cpus;
+
+__attribute__((constructor)) static void record_process_cpus()
+{
+    sched_getaffinity(0, sizeof(process_cpus), &process_cpus);
+}
+
+// pin thread tid to the tid-th core the process may run on
+static void pin_thread(pthread_t thread, int tid)
+{
+    int ncpus = CPU_COUNT(&pool.allowed);
+    if (ncpus < 1) return;
+
+    int nth = tid % ncpus;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (CPU_ISSET(c, &pool.allowed) && nth-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(c, &set);
+            pthread_setaffinity_np(thread, sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+static void *worker(void *data)
+{
+    int tid = (int) (long) data;
+
+    while (true) {
+        // job start
+        pool_barrier(tid);
+        if (pool.quit) break;
+
+        pool.fn(tid, pool.nthreads, pool.arg);
+
+        // job end
+        pool_barrier(tid);
+    }
+    return NULL;
+}
+
+void pool_init(int nthreads)
+{
+    pool.nthreads = nthreads < 1 ? 1 : nthreads;
+    pool.threads = (pthread_t *) malloc(pool.nthreads * sizeof(pthread_t));
+    pool.local_sense = (thread_sense_t *) aligned_alloc(64, 
+        pool.nthreads * sizeof(thread_sense_t));
+    pool.count = pool.nthreads;
+    pool.sense = 0;
+    pool.parked = 0;
+    pool.quit = false;
+
+    for (int t = 0; t < pool.nthreads; t++) {
+        pool.local_sense[t].sense = 0;
+    }
+
+    // the caller keeps its own affinity, it also runs the OpenMP regions
+    pool.allowed = process_cpus;
+    pool.threads[0] = pthread_self();
+    for (int t = 1; t < pool.nthreads; t++) {
+        pthread_create(&pool.threads[t], NULL, worker, (void *) (long) t);
+        pin_thread(pool.threads[t], t);
+    }
+}
+
+void pool_shutdown()
+{
+    pool.quit = true;
+    pool_barrier(0);
+
+    for (int t = 1; t < pool.nthreads; t++) {
+        pthread_join(pool.threads[t], NULL);
+    }
+
+    free(pool.threads);
+    free(pool.local_sense);
+    pool.threads = NULL;
+    pool.local_sense = NULL;
+    pool.nthreads = 0;
+}
+
+int pool_size()
+{
+    return pool.nthreads;
+}
+
+void pool_run(pool_fn_t fn, void *arg)
+{
+    pool.fn = fn;
+    pool.arg = arg;
+
+    pool_barrier(0);
+    fn(0, pool.nthreads, arg);
+    pool_barrier(0);
+}
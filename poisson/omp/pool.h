@@ -0,0 +1,26 @@
+#ifndef POOL_H_
+#define POOL_H_
+
+/**
+ * Persistent worker pool. pool_init starts nthreads - 1 workers, pinned to 
+ * cores, that stay alive until pool_shutdown. The calling thread is thread 
+ * 0 of every job and is left unpinned. Between jobs and at pool_barrier 
+ * threads wait in a sense reversing barrier, spinning first so a job that 
+ * follows closely costs no thread creation or wake up, then parking on a 
+ * futex so idle workers give their cores back.
+ */
+
+// job body, run once by every thread of the pool
+typedef void (*pool_fn_t)(int tid, int nthreads, void *arg);
+
+void pool_init(int nthreads);
+void pool_shutdown();
+int pool_size();
+
+// run fn on all threads and return once every thread has finished it
+void pool_run(pool_fn_t fn, void *arg);
+
+// wait for all threads of the running job
+void pool_barrier(int tid);
+
+#endif